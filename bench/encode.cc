@@ -0,0 +1,110 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include "font.h"
+#include "glyph.h"
+#include "tile.h"
+#include "encoder.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace std;
+
+static const int Frames = 20;
+
+Configuration configuration;
+Statistics statistics;
+
+struct Resolution {
+    int width;
+    int height;
+};
+
+// Client sizes as requested and as the greeter now rounds them to whole tiles.
+static const Resolution Resolutions[] = {
+    {640, 384}, {800, 600}, {768, 576}, {1280, 720}, {1280, 704},
+    {1366, 768}, {1344, 768}, {1920, 1080}, {1920, 1024},
+};
+
+// Fills the screen with text the way the greeter lays out its cells, centered
+// with the leftover pixels as padding.
+static void render_text(vector<uint32_t> &framebuffer, int width, int height) {
+    const GlyphRasterizer &rasterizer = glyph_rasterizer();
+    fill(framebuffer.begin(), framebuffer.end(), 0x00272822);
+    int cols = width / (GlyphWidth / 2);
+    int lines = height / GlyphHeight;
+    int padx = (width - cols * GlyphWidth / 2) / 2;
+    int pady = (height - lines * GlyphHeight) / 2;
+    for (int i = 0; i < lines; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            uint32_t ch = 0x21 + (i * cols + j) * 7 % 94;
+            uint32_t *dst = framebuffer.data() + (pady + i * GlyphHeight) * width + padx + j * GlyphWidth / 2;
+            rasterizer.half_width(GlyphBitmap[ch], dst, width, 0x00f8f8f2, 0x00272822);
+        }
+    }
+}
+
+// Encodes every tile of the screen as its own message, as RDPSession::flush does.
+static size_t encode_screen(Encoder *encoder, TileCodec codec, const vector<uint32_t> &framebuffer,
+    int width, int height, int &partial) {
+    size_t bytes = 0;
+    partial = 0;
+    for (int y = 0; y < height; y += TileTracker::TileSize) {
+        for (int x = 0; x < width; x += TileTracker::TileSize) {
+            int w = min(TileTracker::TileSize, width - x);
+            int h = min(TileTracker::TileSize, height - y);
+            if (w != TileTracker::TileSize || h != TileTracker::TileSize) {
+                ++partial;
+            }
+            const uint8_t *pixels = (const uint8_t *)(framebuffer.data() + y * width + x);
+            Stream_SetPosition(encoder->stream, 0);
+            if (codec == CodecRemoteFX) {
+                RFX_RECT rect = { 0, 0, (UINT16)w, (UINT16)h };
+                rfx_compose_message(encoder->rfx, encoder->stream, &rect, 1, pixels, w, h, width * 4);
+                bytes += Stream_GetPosition(encoder->stream);
+            } else if (codec == CodecNSCodec) {
+                nsc_compose_message(encoder->nsc, encoder->stream, pixels, w, h, width * 4);
+                bytes += Stream_GetPosition(encoder->stream);
+            } else {
+                uint32_t size = Stream_Capacity(encoder->stream);
+                freerdp_bitmap_planar_context_reset(encoder->planar, w, h);
+                freerdp_bitmap_compress_planar(encoder->planar, pixels, PIXEL_FORMAT_BGRX32,
+                    w, h, width * 4, Stream_Buffer(encoder->stream), &size);
+                bytes += size;
+            }
+        }
+    }
+    return bytes;
+}
+
+int main() {
+    configuration.encoder_pool_size = 1;
+    const pair<TileCodec, const char *> codecs[] = {
+        {CodecRemoteFX, "RemoteFX"}, {CodecNSCodec, "NSCodec"}, {CodecPlanar, "Planar"},
+    };
+    for (auto [codec, name] : codecs) {
+        cout << name << ":\n";
+        for (const Resolution &r : Resolutions) {
+            vector<uint32_t> framebuffer(r.width * r.height);
+            render_text(framebuffer, r.width, r.height);
+            Encoder *encoder = encoder_pool.acquire(r.width, r.height);
+            if (!encoder) {
+                cerr << "Failed to create an encoder\n";
+                return 1;
+            }
+            int partial = 0;
+            size_t bytes = 0;
+            auto start = chrono::steady_clock::now();
+            for (int n = 0; n < Frames; ++n) {
+                bytes = encode_screen(encoder, codec, framebuffer, r.width, r.height, partial);
+            }
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+            encoder_pool.release(encoder);
+            double ms = elapsed.count() * 1000 / Frames;
+            cout << "  " << r.width << "x" << r.height << ": " << ms << " ms/frame, "
+                << ms * 1000 * 1000 / (r.width * r.height) << " ns/pixel, " << bytes << " bytes, "
+                << partial << " partial tiles\n";
+        }
+    }
+    return 0;
+}
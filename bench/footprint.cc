@@ -0,0 +1,212 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include "server.h"
+#include "session.h"
+#include "config.h"
+#include "stats.h"
+#include "keymap.h"
+#include "tls.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+namespace beast = boost::beast;
+
+Configuration configuration;
+Statistics statistics;
+
+static const uint16_t ProxyPort = 33891;
+static const size_t RelayBufferSize = 2 * 65536;
+
+static size_t resident_bytes() {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
+    }
+    size_t pages = 0, resident = 0;
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// TPKT + X.224 Connection Request with an optional cookie line and an
+// RDP_NEG_REQ asking for TLS, as mstsc sends it.
+static vector<uint8_t> connection_request(const string &cookie) {
+    vector<uint8_t> pdu = { 0x03, 0x00, 0x00, 0x00, 0x00, 0xe0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    if (!cookie.empty()) {
+        pdu.insert(pdu.end(), cookie.begin(), cookie.end());
+        pdu.push_back('\r');
+        pdu.push_back('\n');
+    }
+    const uint8_t neg_req[] = { 0x01, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00 };
+    pdu.insert(pdu.end(), neg_req, neg_req + sizeof(neg_req));
+    pdu[2] = pdu.size() >> 8;
+    pdu[3] = pdu.size() & 0xff;
+    pdu[4] = pdu.size() - 5;
+    return pdu;
+}
+
+// Answers every token with the backend below.
+static boost::asio::awaitable<void> serve_api(tcp::acceptor &acceptor, uint16_t backend_port) {
+    while (true) {
+        tcp::socket socket = co_await acceptor.async_accept(boost::asio::use_awaitable);
+        try {
+            beast::flat_buffer buffer;
+            beast::http::request<beast::http::string_body> req;
+            co_await beast::http::async_read(socket, buffer, req, boost::asio::use_awaitable);
+            beast::http::response<beast::http::string_body> res(beast::http::status::ok, req.version());
+            res.body() = "{\"status\":\"ok\",\"ip\":\"127.0.0.1\",\"port\":" + to_string(backend_port) + "}";
+            res.prepare_payload();
+            co_await beast::http::async_write(socket, res, boost::asio::use_awaitable);
+        } catch (std::exception &e) {
+        }
+    }
+}
+
+// Accepts relayed connections and keeps them open, like an idle RDP host.
+static boost::asio::awaitable<void> serve_backend(tcp::acceptor &acceptor, vector<tcp::socket> &held) {
+    while (true) {
+        held.push_back(co_await acceptor.async_accept(boost::asio::use_awaitable));
+    }
+}
+
+static bool wait_for(MemoryAccount account, int64_t bytes) {
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(30);
+    while (statistics.memory_bytes[account] < bytes) {
+        if (chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    // Let the sessions settle after the last one was set up.
+    this_thread::sleep_for(chrono::milliseconds(200));
+    return true;
+}
+
+static vector<tcp::socket> open_sessions(boost::asio::io_context &ioc, const string &cookie, int count) {
+    vector<tcp::socket> clients;
+    vector<uint8_t> pdu = connection_request(cookie);
+    for (int i = 0; i < count; i++) {
+        tcp::socket socket(ioc);
+        socket.connect(tcp::endpoint(boost::asio::ip::address_v6::loopback(), ProxyPort));
+        boost::asio::write(socket, boost::asio::buffer(pdu));
+        clients.push_back(move(socket));
+    }
+    return clients;
+}
+
+static void report(const char *name, int count, size_t rss_before, const Statistics &before) {
+    size_t rss = resident_bytes() - rss_before;
+    cout << name << ": " << rss / count / 1024 << " KiB RSS/session, "
+        << (1ull << 30) / max<size_t>(rss / count, 1) << " sessions/GiB\n";
+    const char *accounts[MemoryCount] = { "sessions", "relay buffers", "greeters", "terminals", "encoders",
+        "splashes" };
+    for (int i = 0; i < MemoryCount; i++) {
+        int64_t bytes = statistics.memory_bytes[i] - before.memory_bytes[i];
+        if (bytes != 0) {
+            cout << "  " << accounts[i] << ": " << bytes / count << " bytes/session\n";
+        }
+    }
+    int64_t live = 0;
+    for (int i = 0; i < PhaseCount; i++) {
+        live += statistics.live_bytes[i] - before.live_bytes[i];
+    }
+    cout << "  small blocks (frames, handlers...): " << live / count << " bytes/session\n";
+}
+
+static void snapshot(Statistics &copy) {
+    for (int i = 0; i < MemoryCount; i++) {
+        copy.memory_bytes[i] = statistics.memory_bytes[i].load();
+    }
+    for (int i = 0; i < PhaseCount; i++) {
+        copy.live_bytes[i] = statistics.live_bytes[i].load();
+    }
+}
+
+// Usage: bench_footprint [redirected sessions] [greeters] [certificate chain] [private key]
+int main(int argc, char **argv) {
+    int redirected = argc > 1 ? atoi(argv[1]) : 500;
+    int greeters = argc > 2 ? atoi(argv[2]) : 200;
+    configuration.cert_chain_file = argc > 3 ? argv[3] : "server.crt";
+    configuration.private_key_file = argc > 4 ? argv[4] : "server.key";
+    if (!load_tls_credentials() || !install_tls_hook()) {
+        return 1;
+    }
+    // Each redirected session takes four descriptors in this process.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (!shared_keymap()) {
+        cerr << "Failed to compile the XKB keymap, set XKB_CONFIG_ROOT\n";
+        return 1;
+    }
+
+    boost::asio::io_context ioc;
+    tcp::acceptor api(ioc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::acceptor backend(ioc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    vector<tcp::socket> held;
+    boost::asio::co_spawn(ioc, serve_api(api, backend.local_endpoint().port()), boost::asio::detached);
+    boost::asio::co_spawn(ioc, serve_backend(backend, held), boost::asio::detached);
+    thread services([&ioc] { ioc.run(); });
+
+    configuration.port = ProxyPort;
+    configuration.api_host = "127.0.0.1";
+    configuration.api_port = to_string(api.local_endpoint().port());
+    configuration.api_path = "/";
+    configuration.threads = 1;
+    configuration.pending_accepts = 4;
+    configuration.defer_accept = 0;
+    configuration.reuseport_cpu = false;
+    configuration.encoder_pool_size = 4;
+    configuration.max_desktop_width = 1920;
+    configuration.max_desktop_height = 1080;
+    configuration.backend_two_choices = false;
+    configuration.backend_connect_timeout = 3000;
+    configuration.backend_failure_threshold = 3;
+    configuration.backend_open_time = 10000;
+    configuration.backend_probe_interval = 0;
+    RDPProxyServer server;
+    thread proxy([&server] { server.run(); });
+
+    boost::asio::io_context client_ioc;
+    Statistics before;
+    {
+        // Warm up the allocator caches and lazily created shared state.
+        vector<tcp::socket> warm = open_sessions(client_ioc, "Cookie: msts=bench", 16);
+        vector<tcp::socket> warm_greeters = open_sessions(client_ioc, "", 4);
+        wait_for(MemoryRelayBuffers, 16 * RelayBufferSize);
+    }
+    this_thread::sleep_for(chrono::seconds(1));
+
+    snapshot(before);
+    size_t rss_before = resident_bytes();
+    vector<tcp::socket> clients = open_sessions(client_ioc, "Cookie: msts=bench", redirected);
+    if (!wait_for(MemoryRelayBuffers, before.memory_bytes[MemoryRelayBuffers] + redirected * RelayBufferSize)) {
+        cerr << "Redirected sessions did not come up\n";
+        return 1;
+    }
+    report("idle redirected", redirected, rss_before, before);
+
+    snapshot(before);
+    rss_before = resident_bytes();
+    vector<tcp::socket> greeter_clients = open_sessions(client_ioc, "", greeters);
+    if (!wait_for(MemoryGreeters, before.memory_bytes[MemoryGreeters] + greeters * sizeof(RDPSession))) {
+        cerr << "Greeters did not come up\n";
+        return 1;
+    }
+    report("idle greeter", greeters, rss_before, before);
+    // The proxy's threads never return.
+    _exit(0);
+}
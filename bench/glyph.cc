@@ -0,0 +1,61 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "font.h"
+#include "glyph.h"
+
+using namespace std;
+
+static const int Columns = 80;
+static const int Glyphs = 4000000;
+
+static double measure(GlyphKernel kernel, int width, vector<uint32_t> &framebuffer) {
+    int stride = Columns * GlyphWidth;
+    auto start = chrono::steady_clock::now();
+    for (int n = 0; n < Glyphs; ++n) {
+        // Walk the CJK and Latin ranges so the bitmaps do not all stay in L1.
+        uint32_t ch = (uint32_t)n * 7919 % GlyphBitmapSize;
+        uint32_t *dst = framebuffer.data() + (n % Columns) * width;
+        kernel(GlyphBitmap[ch], dst, stride, 0x00f8f8f2, 0x00272822);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return Glyphs / elapsed.count();
+}
+
+static bool verify(const GlyphRasterizer &reference, const GlyphRasterizer &rasterizer) {
+    uint32_t expected[GlyphHeight * GlyphWidth];
+    uint32_t actual[GlyphHeight * GlyphWidth];
+    for (uint32_t ch = 0; ch < GlyphBitmapSize; ++ch) {
+        reference.full_width(GlyphBitmap[ch], expected, GlyphWidth, 0x00ffffff, 0x00000000);
+        rasterizer.full_width(GlyphBitmap[ch], actual, GlyphWidth, 0x00ffffff, 0x00000000);
+        if (memcmp(expected, actual, sizeof(expected))) {
+            return false;
+        }
+        reference.half_width(GlyphBitmap[ch], expected, GlyphWidth, 0x00ffffff, 0x00000000);
+        rasterizer.half_width(GlyphBitmap[ch], actual, GlyphWidth, 0x00ffffff, 0x00000000);
+        for (int i = 0; i < GlyphHeight; ++i) {
+            if (memcmp(expected + i * GlyphWidth, actual + i * GlyphWidth, GlyphWidth / 2 * 4)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main() {
+    vector<uint32_t> framebuffer(Columns * GlyphWidth * GlyphHeight);
+    vector<GlyphRasterizer> rasterizers = available_glyph_rasterizers();
+    cout << "selected: " << glyph_rasterizer().name << "\n";
+    for (const GlyphRasterizer &rasterizer : rasterizers) {
+        if (!verify(rasterizers.front(), rasterizer)) {
+            cout << rasterizer.name << ": output differs from scalar\n";
+            return 1;
+        }
+        double half = measure(rasterizer.half_width, GlyphWidth / 2, framebuffer);
+        double full = measure(rasterizer.full_width, GlyphWidth, framebuffer);
+        cout << rasterizer.name << ": half-width " << (uint64_t)half << " glyphs/s, full-width "
+            << (uint64_t)full << " glyphs/s\n";
+    }
+    return 0;
+}
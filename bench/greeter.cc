@@ -0,0 +1,139 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include <time.h>
+#include "screen.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace std;
+
+Configuration configuration;
+Statistics statistics;
+
+static atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+    ++allocations;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// Counts what would have been sent to the client.
+class NullSink : public ScreenSink {
+public:
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    void begin_frame(uint32_t) override {}
+    void end_frame(uint32_t) override {
+        ++frames;
+    }
+    void surface_bits(const SURFACE_BITS_COMMAND &cmd) override {
+        bytes += cmd.bmp.bitmapDataLength;
+    }
+    void bitmap(const BITMAP_DATA &bitmap) override {
+        bytes += bitmap.bitmapLength;
+    }
+    void screen_blt(const SCRBLT_ORDER &) override {
+        bytes += 16;
+    }
+};
+
+// One terminal write per keystroke, as the greeter echoes them.
+using Script = vector<string>;
+
+static void type(Script &script, const string &prompt, const string &text, char mask = 0) {
+    script.push_back(prompt);
+    for (char ch : text) {
+        script.push_back(string(1, mask ? mask : ch));
+    }
+}
+
+static Script typing_script() {
+    Script script;
+    type(script, "学号或工号: ", "PB17000001");
+    return script;
+}
+
+static Script failed_login_script() {
+    Script script;
+    for (int i = 0; i < 5; ++i) {
+        type(script, "学号或工号: ", "PB17000001");
+        type(script, "\r\n密码: ", "wrong password", '*');
+        script.push_back("\r\n登录中，请稍候…\r\n");
+        script.push_back("登录失败！请重试。\r\n");
+    }
+    return script;
+}
+
+static double cpu_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const char *name, const ScreenCodecs &codecs, int width, int height,
+    const Script &script, int sessions) {
+    NullSink sink;
+    uint64_t writes = 0;
+    uint64_t allocations_before = allocations;
+    double cpu_before = cpu_seconds();
+    auto start = chrono::steady_clock::now();
+    for (int n = 0; n < sessions; ++n) {
+        GreeterScreen screen(sink);
+        if (!screen.init(width, height)) {
+            cerr << "Failed to create the terminal\n";
+            exit(1);
+        }
+        screen.activate(codecs);
+        for (const string &s : script) {
+            screen.write(s.data(), s.length());
+            screen.flush();
+            ++writes;
+        }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    double cpu = cpu_seconds() - cpu_before;
+    uint64_t allocated = allocations - allocations_before;
+    uint64_t frames = max<uint64_t>(sink.frames, 1);
+    writes = max<uint64_t>(writes, 1);
+    cout << "  " << name << ": " << (uint64_t)(sink.frames / elapsed.count()) << " frames/s, "
+        << sink.bytes / frames << " bytes/frame, " << cpu * 1e6 / writes << " us CPU/keystroke, "
+        << (double)allocated / writes << " allocations/keystroke\n";
+}
+
+int main() {
+    configuration.encoder_pool_size = 1;
+    const pair<const char *, ScreenCodecs> clients[] = {
+        {"RemoteFX", {true, true, true, 32, true, 3, 1}},
+        {"NSCodec", {false, true, true, 32, true, 0, 1}},
+        {"bitmaps", {false, false, true, 32, true, 0, 0}},
+        {"bitmaps, 16bpp, no ScrBlt", {false, false, false, 16, true, 0, 0}},
+    };
+    Script splash;
+    Script typing = typing_script();
+    Script failed_login = failed_login_script();
+    for (auto [client, codecs] : clients) {
+        cout << client << ":\n";
+        run("splash", codecs, 640, 384, splash, 200);
+        run("typing", codecs, 640, 384, typing, 200);
+        run("failed logins", codecs, 640, 384, failed_login, 50);
+        run("failed logins 1920x1024", codecs, 1920, 1024, failed_login, 20);
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <chrono>
+#include <iostream>
+#include "keymap.h"
+
+using namespace std;
+
+static const int Connections = 200;
+
+// What every greeter connection used to do: a fresh context, a keymap
+// compiled from XKB_CONFIG_ROOT and a state on top of it.
+static double measure_compile() {
+    auto start = chrono::steady_clock::now();
+    for (int n = 0; n < Connections; ++n) {
+        xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+        xkb_keymap *keymap = xkb_keymap_new_from_names(context, nullptr, XKB_KEYMAP_COMPILE_NO_FLAGS);
+        xkb_state *state = xkb_state_new(keymap);
+        if (!state) {
+            cerr << "Failed to compile the XKB keymap\n";
+            exit(1);
+        }
+        xkb_state_unref(state);
+        xkb_keymap_unref(keymap);
+        xkb_context_unref(context);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / Connections;
+}
+
+static double measure_shared() {
+    auto start = chrono::steady_clock::now();
+    for (int n = 0; n < Connections; ++n) {
+        xkb_state *state = keyboard_state_new();
+        if (!state) {
+            cerr << "Failed to create the XKB state\n";
+            exit(1);
+        }
+        keyboard_state_free(state);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / Connections;
+}
+
+int main() {
+    auto start = chrono::steady_clock::now();
+    if (!shared_keymap()) {
+        cerr << "Failed to compile the XKB keymap\n";
+        return 1;
+    }
+    chrono::duration<double> startup = chrono::steady_clock::now() - start;
+    cout << "startup compile: " << startup.count() * 1e6 << " us\n";
+    cout << "per connection, compiled keymap: " << measure_compile() * 1e6 << " us\n";
+    cout << "per connection, shared keymap:   " << measure_shared() * 1e6 << " us\n";
+    return 0;
+}
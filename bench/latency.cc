@@ -0,0 +1,251 @@
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include "server.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+namespace beast = boost::beast;
+
+Configuration configuration;
+Statistics statistics;
+
+static const uint16_t ProxyPort = 33892;
+// Frames from the host: a type byte, a 16-bit big-endian length, the payload.
+static const uint8_t FrameBulk = 'B';
+static const uint8_t FrameEcho = 'E';
+static const size_t BulkFrameSize = 16384;
+static const size_t HostNotSentLowat = 16384;
+static const size_t ClientReceiveBuffer = 65536;
+static const auto PingInterval = chrono::milliseconds(20);
+
+static int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// TPKT + X.224 Connection Request with the routing cookie, as mstsc sends it.
+static vector<uint8_t> connection_request(const string &cookie) {
+    vector<uint8_t> pdu = { 0x03, 0x00, 0x00, 0x00, 0x00, 0xe0, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    pdu.insert(pdu.end(), cookie.begin(), cookie.end());
+    pdu.push_back('\r');
+    pdu.push_back('\n');
+    const uint8_t neg_req[] = { 0x01, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00 };
+    pdu.insert(pdu.end(), neg_req, neg_req + sizeof(neg_req));
+    pdu[2] = pdu.size() >> 8;
+    pdu[3] = pdu.size() & 0xff;
+    pdu[4] = pdu.size() - 5;
+    return pdu;
+}
+
+// Answers every token with the host below.
+static boost::asio::awaitable<void> serve_api(tcp::acceptor &acceptor, uint16_t host_port) {
+    while (true) {
+        tcp::socket socket = co_await acceptor.async_accept(boost::asio::use_awaitable);
+        try {
+            beast::flat_buffer buffer;
+            beast::http::request<beast::http::string_body> req;
+            co_await beast::http::async_read(socket, buffer, req, boost::asio::use_awaitable);
+            beast::http::response<beast::http::string_body> res(beast::http::status::ok, req.version());
+            res.body() = "{\"status\":\"ok\",\"ip\":\"127.0.0.1\",\"port\":" + to_string(host_port) + "}";
+            res.prepare_payload();
+            co_await beast::http::async_write(socket, res, boost::asio::use_awaitable);
+        } catch (std::exception &e) {
+        }
+    }
+}
+
+static void write_frame(tcp::socket &socket, uint8_t type, const uint8_t *payload, size_t size) {
+    vector<uint8_t> frame = { type, (uint8_t)(size >> 8), (uint8_t)(size & 0xff) };
+    frame.insert(frame.end(), payload, payload + size);
+    boost::asio::write(socket, boost::asio::buffer(frame));
+}
+
+// Plays an RDP host busy with a bulk update that echoes every input event
+// right after the frame it is writing. Like a real host it only produces what
+// its socket takes, so a backlog at the proxy shows up as echo latency.
+static void serve_host(tcp::socket socket, size_t request_size) {
+    int lowat = HostNotSentLowat;
+    setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    socket.set_option(tcp::no_delay(true));
+    try {
+        vector<uint8_t> request(request_size);
+        boost::asio::read(socket, boost::asio::buffer(request));
+    } catch (std::exception &e) {
+        return;
+    }
+    std::mutex mutex;
+    atomic<bool> done(false);
+    thread echo([&] {
+        uint8_t ping[8];
+        try {
+            while (true) {
+                boost::asio::read(socket, boost::asio::buffer(ping));
+                lock_guard<std::mutex> lock(mutex);
+                write_frame(socket, FrameEcho, ping, sizeof(ping));
+            }
+        } catch (std::exception &e) {
+        }
+        done = true;
+    });
+    vector<uint8_t> bulk(BulkFrameSize - 3);
+    try {
+        while (!done) {
+            lock_guard<std::mutex> lock(mutex);
+            write_frame(socket, FrameBulk, bulk.data(), bulk.size());
+        }
+    } catch (std::exception &e) {
+    }
+    boost::system::error_code ec;
+    socket.shutdown(tcp::socket::shutdown_both, ec);
+    echo.join();
+}
+
+struct Round {
+    vector<double> latencies;
+    uint64_t bytes;
+};
+
+// A client on a slow link: it reads rate bytes/s with a small receive window
+// and sends an input event every PingInterval, timing its echo.
+static Round run_round(boost::asio::io_context &ioc, uint16_t port, size_t rate, int seconds) {
+    Round round = { {}, 0 };
+    tcp::socket socket(ioc);
+    socket.open(tcp::v6());
+    socket.set_option(boost::asio::socket_base::receive_buffer_size(ClientReceiveBuffer));
+    socket.set_option(tcp::no_delay(true));
+    socket.connect(tcp::endpoint(boost::asio::ip::address_v6::loopback(), port));
+    boost::asio::write(socket, boost::asio::buffer(connection_request("Cookie: msts=bench")));
+    atomic<bool> stop(false);
+    thread reader([&] {
+        vector<uint8_t> buffer(65536);
+        vector<uint8_t> pending;
+        auto start = chrono::steady_clock::now();
+        try {
+            while (!stop) {
+                double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                size_t allowed = elapsed * rate > round.bytes ? elapsed * rate - round.bytes : 0;
+                if (allowed == 0) {
+                    this_thread::sleep_for(chrono::milliseconds(1));
+                    continue;
+                }
+                size_t size = socket.read_some(boost::asio::buffer(buffer.data(), min(allowed, buffer.size())));
+                round.bytes += size;
+                pending.insert(pending.end(), buffer.begin(), buffer.begin() + size);
+                size_t offset = 0;
+                while (pending.size() - offset >= 3) {
+                    size_t length = (pending[offset + 1] << 8) | pending[offset + 2];
+                    if (pending.size() - offset < 3 + length) {
+                        break;
+                    }
+                    if (pending[offset] == FrameEcho && length == 8) {
+                        int64_t sent;
+                        memcpy(&sent, &pending[offset + 3], sizeof(sent));
+                        round.latencies.push_back((now_ns() - sent) / 1e6);
+                    }
+                    offset += 3 + length;
+                }
+                pending.erase(pending.begin(), pending.begin() + offset);
+            }
+        } catch (std::exception &e) {
+        }
+    });
+    auto end = chrono::steady_clock::now() + chrono::seconds(seconds);
+    while (chrono::steady_clock::now() < end) {
+        int64_t sent = now_ns();
+        boost::asio::write(socket, boost::asio::buffer(&sent, sizeof(sent)));
+        this_thread::sleep_for(PingInterval);
+    }
+    stop = true;
+    shutdown(socket.native_handle(), SHUT_RDWR);
+    reader.join();
+    return round;
+}
+
+static void report(const char *name, Round &round, int seconds, uint64_t write_waits) {
+    vector<double> &l = round.latencies;
+    sort(l.begin(), l.end());
+    cout << name << ": " << round.bytes / seconds / 1024 << " KiB/s received, " << l.size() << " echoes";
+    if (!l.empty()) {
+        cout << ", latency median " << l[l.size() / 2] << " ms, p99 " << l[l.size() * 99 / 100]
+            << " ms, max " << l.back() << " ms";
+    }
+    cout << ", " << write_waits << " relay write waits\n";
+}
+
+// Runs a round against a proxy of its own in a child process, configured
+// before its threads start since they read the configuration unsynchronized.
+static void run_proxy(const char *name, uint16_t port, uint32_t lowat, uint32_t receive_buffer,
+    size_t rate, int seconds) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        cerr << "Cannot fork the proxy.\n";
+        exit(1);
+    }
+    if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+        return;
+    }
+    configuration.port = port;
+    configuration.relay_notsent_lowat = lowat;
+    configuration.relay_receive_buffer = receive_buffer;
+    RDPProxyServer server;
+    thread proxy([&server] { server.run(); });
+    boost::asio::io_context ioc;
+    Round round = run_round(ioc, port, rate, seconds);
+    report(name, round, seconds, statistics.relay_write_waits);
+    // The proxy's threads never return.
+    cout.flush();
+    _exit(0);
+}
+
+// Usage: bench_latency [client KiB/s] [relay_notsent_lowat] [relay_receive_buffer] [seconds per round]
+int main(int argc, char **argv) {
+    size_t rate = (argc > 1 ? atoi(argv[1]) : 1024) * 1024;
+    uint32_t lowat = argc > 2 ? atoi(argv[2]) : 16384;
+    uint32_t receive_buffer = argc > 3 ? atoi(argv[3]) : 65536;
+    int seconds = argc > 4 ? atoi(argv[4]) : 10;
+
+    boost::asio::io_context ioc;
+    tcp::acceptor api(ioc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::acceptor host(ioc, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    configuration.api_host = "127.0.0.1";
+    configuration.api_port = to_string(api.local_endpoint().port());
+    configuration.api_path = "/";
+    configuration.threads = 1;
+    configuration.pending_accepts = 1;
+    configuration.defer_accept = 0;
+    configuration.backend_connect_timeout = 3000;
+    configuration.backend_failure_threshold = 3;
+    configuration.backend_open_time = 10000;
+    boost::asio::co_spawn(ioc, serve_api(api, host.local_endpoint().port()), boost::asio::detached);
+    thread services([&ioc] { ioc.run(); });
+    size_t request_size = connection_request("Cookie: msts=bench").size();
+    thread hosts([&host, request_size] {
+        while (true) {
+            tcp::socket socket = host.accept();
+            thread(serve_host, move(socket), request_size).detach();
+        }
+    });
+
+    // A port per round, so the second proxy does not wait for the first one's.
+    run_proxy("default relay", ProxyPort, 0, 0, rate, seconds);
+    run_proxy("latency mode", ProxyPort + 1, lowat, receive_buffer, rate, seconds);
+    // The services' threads never return.
+    _exit(0);
+}
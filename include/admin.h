@@ -0,0 +1,14 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+
+// Serves admin_socket, a Unix socket taking one command per line and
+// answering with one line per item followed by an empty line:
+//   sessions   every session: id, client address, mode, backend, token hash,
+//              age in seconds, bytes and bytes/s up and down, then milliseconds
+//              spent waiting for rate limits
+//   top N      the N relayed sessions moving the most bytes/s
+//   kill ID    ends a session
+//   stats      the counters printed on SIGUSR1
+//   backends   load and health of each backend
+boost::asio::awaitable<void> serve_admin(boost::asio::io_context &ioc);
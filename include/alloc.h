@@ -0,0 +1,12 @@
+#pragma once
+#include "stats.h"
+
+// rdpproxy replaces the global operator new and delete with per-thread free
+// lists of small blocks, so the coroutine frames, Session objects and handlers
+// of a connection reuse the memory of previous ones instead of going to malloc.
+//
+// Allocations are counted against what the allocating thread was doing, set
+// with set_allocation_phase() where a connection moves to its next phase.
+// Coroutines of other connections may run in between, so the split is
+// approximate.
+void set_allocation_phase(AllocationPhase phase);
@@ -1,6 +1,7 @@
 #pragma once
 #include <tuple>
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/awaitable.hpp>
@@ -8,8 +9,10 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
+#include "backend.h"
 
+// rate_limit is the API's cap on the session's bytes/s toward the client, 0 if none.
 boost::asio::awaitable<bool> auth(const std::string &token, std::string &username,
-    std::string &ip, uint16_t &port, boost::asio::io_context &ioc);
+    std::vector<Backend> &backends, uint64_t &rate_limit, boost::asio::io_context &ioc);
 boost::asio::awaitable<bool> auth(const std::string &username, const std::string &password,
     std::string &ip, std::string &host_username, std::string &token, boost::asio::io_context &ioc);
\ No newline at end of file
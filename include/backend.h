@@ -0,0 +1,90 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <inttypes.h>
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include "throttle.h"
+
+struct Backend {
+    std::string ip;
+    uint16_t port;
+};
+
+struct BackendStats {
+    Backend backend;
+    bool healthy;
+    int active_relays;
+    uint64_t connects;
+    uint64_t connect_failures;
+    uint64_t fast_failures;
+    uint64_t probes;
+    uint64_t probe_failures;
+};
+
+// A backend's share of backend_rate_limit. Its relays take from it under its
+// own lock rather than the registry's.
+struct BackendLimit {
+    // Takes size bytes relayed from the backend to a client, returns how long
+    // to wait before sending them.
+    std::chrono::nanoseconds take(size_t size);
+    std::mutex mutex;
+    TokenBucket bucket;
+};
+
+// Load and health of every backend the API handed out. A session holds its
+// backend from a successful connect until it closes. Connect outcomes feed a
+// circuit breaker per backend: after backend_failure_threshold consecutive
+// failures it opens and the backend is skipped for backend_open_time, then a
+// single connection is let through to test it.
+class BackendRegistry {
+public:
+    BackendRegistry();
+    // Candidates in the order they should be tried: the chosen one first, then
+    // the others by load so that a failed connect falls back to the next least
+    // loaded one. Backends with an open breaker come last.
+    std::vector<Backend> order(const std::vector<Backend> &candidates);
+    // Whether a connection may be attempted; false while the breaker is open.
+    bool admit(const Backend &backend);
+    void report(const Backend &backend, bool success, bool probe = false);
+    void acquire(const Backend &backend);
+    void release(const Backend &backend);
+    // The backend's rate limit, valid for the lifetime of the process.
+    BackendLimit *limit(const Backend &backend);
+    std::vector<Backend> unhealthy();
+    std::vector<BackendStats> stats();
+private:
+    struct BackendState {
+        Backend backend;
+        int active_relays;
+        int failures;
+        bool open;
+        bool trial;
+        std::chrono::steady_clock::time_point open_until;
+        uint64_t connects;
+        uint64_t connect_failures;
+        uint64_t fast_failures;
+        uint64_t probes;
+        uint64_t probe_failures;
+        std::unique_ptr<BackendLimit> limit;
+    };
+    BackendState &state(const Backend &backend);
+    std::mutex mutex;
+    std::map<std::string, BackendState> states;
+    std::minstd_rand rng;
+};
+
+extern BackendRegistry backend_registry;
+
+// Connects socket to backend, giving up after timeout milliseconds.
+boost::asio::awaitable<boost::system::error_code> connect_backend(
+    boost::asio::ip::tcp::socket &socket, const Backend &backend, uint32_t timeout);
+// Periodically connects to backends with an open breaker so that they are put
+// back in rotation as soon as they come up rather than by a user's connection.
+boost::asio::awaitable<void> probe_backends(boost::asio::io_context &ioc);
@@ -11,8 +11,34 @@ struct Configuration {
     std::string cert_chain_file;
     std::string private_key_file;
     std::string dhparam_file;
+    uint32_t tls_session_cache_size;
+    uint32_t tls_session_timeout;
     uint16_t port;
     uint32_t threads;
+    uint32_t pending_accepts;
+    int defer_accept;
+    bool reuseport_cpu;
+    uint32_t encoder_pool_size;
+    int max_desktop_width;
+    int max_desktop_height;
+    bool backend_two_choices;
+    uint32_t backend_connect_timeout;
+    uint32_t backend_failure_threshold;
+    uint32_t backend_open_time;
+    uint32_t backend_probe_interval;
+    std::string upgrade_socket;
+    uint32_t upgrade_drain_timeout;
+    uint32_t processes;
+    uint32_t auth_cache_size;
+    uint32_t auth_cache_ttl;
+    std::string admin_socket;
+    uint32_t relay_notsent_lowat;
+    uint32_t relay_send_buffer;
+    uint32_t relay_receive_buffer;
+    bool relay_framing;
+    uint64_t rate_limit;
+    uint64_t session_rate_limit;
+    uint64_t backend_rate_limit;
 };
 
 bool load_configuration(const std::string &filename, Configuration &config);
\ No newline at end of file
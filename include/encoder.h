@@ -0,0 +1,45 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <freerdp/codec/rfx.h>
+#include <freerdp/codec/nsc.h>
+#include <freerdp/codec/planar.h>
+#include <freerdp/codec/interleaved.h>
+#include <winpr/stream.h>
+
+// Codec contexts, the stream they encode into and a scratch buffer the caller
+// renders into before encoding. RemoteFX contexts carry their own quantization
+// tables, tile pools and worker threads, so they are reused across greeter
+// sessions instead of being created per connection.
+struct Encoder {
+    RFX_CONTEXT *rfx;
+    NSC_CONTEXT *nsc;
+    // Planar without and with the alpha plane, for clients that do and do not
+    // allow skipping it.
+    BITMAP_PLANAR_CONTEXT *planar;
+    BITMAP_PLANAR_CONTEXT *planar_alpha;
+    BITMAP_INTERLEAVED_CONTEXT *interleaved;
+    wStream *stream;
+    std::vector<uint32_t> scratch;
+    // Heap bytes the codec contexts took when created.
+    size_t footprint;
+};
+
+// Bounded pool of idle encoders. Sessions hold one only while sending an update;
+// encoders beyond configuration.encoder_pool_size are freed.
+class EncoderPool {
+public:
+    EncoderPool();
+    ~EncoderPool();
+    Encoder *acquire(int width, int height);
+    void release(Encoder *encoder);
+private:
+    Encoder *create();
+    static void destroy(Encoder *encoder);
+    std::mutex mutex;
+    std::vector<Encoder *> idle;
+    std::atomic<uint64_t> encoder_size;
+};
+
+extern EncoderPool encoder_pool;
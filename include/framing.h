@@ -0,0 +1,37 @@
+#pragma once
+#include <stddef.h>
+#include <inttypes.h>
+#include "stats.h"
+
+// Follows the PDU boundaries of one direction of a relayed connection from the
+// lengths in their headers: TPKT and fast-path PDUs until the peers start TLS,
+// which hides everything but TLS records from then on. Fast-path PDUs from the
+// client and small TLS records from the client are input, the other fast-path
+// PDUs and TLS application data graphics, bulk for larger records from the
+// client; TPKT PDUs and TLS handshakes are control. A header that fits none of
+// these leaves the rest of the stream unknown.
+class PduFramer {
+public:
+    explicit PduFramer(bool from_client_);
+    // Accounts the next size bytes of the stream, returns how many of them
+    // were not input.
+    size_t consume(const uint8_t *data, size_t size);
+    // Adds the counts since the last call to statistics.
+    void publish();
+private:
+    enum FramingMode {
+        FramingRdp,
+        FramingTls,
+        FramingLost
+    };
+    size_t header_size_needed() const;
+    void start_pdu();
+    bool from_client;
+    FramingMode mode;
+    uint8_t header[5];
+    size_t header_size;
+    size_t remaining;
+    PduClass current;
+    uint64_t bytes[PduClassCount];
+    uint64_t pdus[PduClassCount];
+};
@@ -0,0 +1,34 @@
+#pragma once
+#include <vector>
+#include <inttypes.h>
+#include "font.h"
+
+// Expands a glyph bitmap into GlyphHeight rows of fg/bg pixels.
+typedef void (*GlyphKernel)(const uint16_t *bitmap, uint32_t *dst, int stride, uint32_t fg, uint32_t bg);
+
+struct GlyphRasterizer {
+    const char *name;
+    GlyphKernel half_width;
+    GlyphKernel full_width;
+};
+
+// Rasterizers usable on this CPU, from the slowest to the fastest.
+std::vector<GlyphRasterizer> available_glyph_rasterizers();
+// The fastest usable rasterizer, selected on first use.
+const GlyphRasterizer &glyph_rasterizer();
+
+// Cells are rasterized each time they are drawn rather than cached: a rendered
+// full-width cell is 32 times the bytes of its bitmap, so copying it from a
+// cache costs more than the SSE2/AVX2 kernels take to expand the bitmap.
+template <int Width>
+void rasterize_glyph(const uint16_t *bitmap, uint32_t *dst, int stride, uint32_t fg, uint32_t bg);
+
+template <>
+inline void rasterize_glyph<GlyphWidth / 2>(const uint16_t *bitmap, uint32_t *dst, int stride, uint32_t fg, uint32_t bg) {
+    glyph_rasterizer().half_width(bitmap, dst, stride, fg, bg);
+}
+
+template <>
+inline void rasterize_glyph<GlyphWidth>(const uint16_t *bitmap, uint32_t *dst, int stride, uint32_t fg, uint32_t bg) {
+    glyph_rasterizer().full_width(bitmap, dst, stride, fg, bg);
+}
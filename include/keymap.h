@@ -0,0 +1,10 @@
+#pragma once
+#include <string>
+#include <xkbcommon/xkbcommon.h>
+
+// Compiled keymaps are shared by every session. Each layout ("" is the XKB
+// default) is compiled on first use and kept for the lifetime of the process;
+// sessions only own the xkb_state tracking their modifiers.
+xkb_keymap *shared_keymap(const std::string &layout = "");
+xkb_state *keyboard_state_new(const std::string &layout = "");
+void keyboard_state_free(xkb_state *state);
@@ -0,0 +1,79 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <inttypes.h>
+
+class Session;
+
+enum SessionMode {
+    ModeHandshake,
+    ModeGreeter,
+    ModeRelay
+};
+
+// Indexes the per-direction counters: client to backend, backend to client.
+enum RelayDirection {
+    DirectionUp,
+    DirectionDown,
+    DirectionCount
+};
+
+// What the admin endpoint shows of a session.
+struct SessionInfo {
+    Session *session;
+    uint64_t id;
+    std::string ip;
+    std::chrono::steady_clock::time_point created;
+    std::atomic<int> mode;
+    // Set before mode turns to ModeRelay, constant afterwards.
+    std::string backend;
+    uint64_t token_hash;
+    // Only written by the session's thread, so updates need no atomic
+    // read-modify-write.
+    std::atomic<uint64_t> bytes[DirectionCount];
+    // Time relaying toward the client waited for rate limits.
+    std::atomic<uint64_t> throttled_nanoseconds;
+    // Bytes per second over the last second, updated by the admin sampler.
+    uint64_t sampled_bytes[DirectionCount];
+    uint64_t rates[DirectionCount];
+};
+
+struct SessionShard {
+    std::mutex mutex;
+    std::unordered_set<SessionInfo *> sessions;
+};
+
+// Sessions by the thread that created them. A session takes its shard's lock
+// only when it is created and destroyed, never while relaying; the admin
+// endpoint takes one shard's lock at a time.
+class SessionRegistry {
+public:
+    uint64_t next_id();
+    // Adds the session to the calling thread's shard, which it returns.
+    SessionShard *add(SessionInfo *info);
+    void remove(SessionShard *shard, SessionInfo *info);
+    template <class F>
+    void for_each(F f);
+private:
+    std::vector<SessionShard *> all_shards();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<SessionShard>> shards;
+    std::atomic<uint64_t> last_id;
+};
+
+template <class F>
+void SessionRegistry::for_each(F f) {
+    for (SessionShard *shard : all_shards()) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        for (SessionInfo *info : shard->sessions) {
+            f(*info);
+        }
+    }
+}
+
+extern SessionRegistry session_registry;
@@ -0,0 +1,133 @@
+#pragma once
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <inttypes.h>
+
+// Lock-free single-producer/single-consumer byte ring with an eventfd doorbell.
+// The doorbell is only rung when the consumer announced, after finding the ring
+// empty, that it is about to sleep on it, so a burst of writes costs at most one
+// wakeup and a busy consumer none.
+//
+// Consumer loop: read() until it returns 0, then wait_prepare(); if that returns
+// true, sleep until doorbell() is readable and call wait_finish().
+//
+// A producer that needs to wait for room does the same with room_wait_prepare(),
+// room_doorbell() and room_wait_finish() after a short write(). The room doorbell
+// only exists in rings constructed with waits_for_room.
+template<size_t Capacity>
+class ByteRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+public:
+    explicit ByteRing(bool waits_for_room = false) : head(0), tail(0), waiting(false), room_waiting(false),
+        room_fd(-1) {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (waits_for_room) {
+            room_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+    }
+
+    ~ByteRing() {
+        if (event_fd != -1) {
+            close(event_fd);
+        }
+        if (room_fd != -1) {
+            close(room_fd);
+        }
+    }
+
+    ByteRing(const ByteRing &) = delete;
+    ByteRing &operator=(const ByteRing &) = delete;
+
+    int doorbell() const {
+        return event_fd;
+    }
+
+    int room_doorbell() const {
+        return room_fd;
+    }
+
+    // Producer side. Returns the number of bytes written, short if the ring is full.
+    size_t write(const void *data, size_t len) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        len = std::min(len, Capacity - (h - t));
+        if (len == 0) {
+            return 0;
+        }
+        size_t offset = h & (Capacity - 1);
+        size_t first = std::min(len, Capacity - offset);
+        memcpy(buffer + offset, data, first);
+        memcpy(buffer, (const char *)data + first, len - first);
+        // Paired with wait_prepare(): either the consumer sees the new head or we
+        // see that it is waiting.
+        head.store(h + len, std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_seq_cst) && waiting.exchange(false)) {
+            uint64_t one = 1;
+            ::write(event_fd, &one, sizeof(one));
+        }
+        return len;
+    }
+
+    // Consumer side. Returns the number of bytes read, 0 if the ring is empty.
+    size_t read(void *data, size_t len) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        len = std::min(len, h - t);
+        if (len == 0) {
+            return 0;
+        }
+        size_t offset = t & (Capacity - 1);
+        size_t first = std::min(len, Capacity - offset);
+        memcpy(data, buffer + offset, first);
+        memcpy((char *)data + first, buffer, len - first);
+        // Paired with room_wait_prepare() like write() with wait_prepare().
+        tail.store(t + len, std::memory_order_seq_cst);
+        if (room_waiting.load(std::memory_order_seq_cst) && room_waiting.exchange(false)) {
+            uint64_t one = 1;
+            ::write(room_fd, &one, sizeof(one));
+        }
+        return len;
+    }
+
+    // Returns false if data arrived in the meantime and the consumer should not sleep.
+    bool wait_prepare() {
+        waiting.store(true, std::memory_order_seq_cst);
+        if (head.load(std::memory_order_seq_cst) != tail.load(std::memory_order_relaxed)) {
+            waiting.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    void wait_finish() {
+        uint64_t count;
+        ::read(event_fd, &count, sizeof(count));
+    }
+
+    // Returns false if room was made in the meantime and the producer should not sleep.
+    bool room_wait_prepare() {
+        room_waiting.store(true, std::memory_order_seq_cst);
+        if (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_seq_cst) < Capacity) {
+            room_waiting.store(false, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    void room_wait_finish() {
+        uint64_t count;
+        ::read(room_fd, &count, sizeof(count));
+    }
+
+private:
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    std::atomic<bool> waiting;
+    std::atomic<bool> room_waiting;
+    int event_fd;
+    int room_fd;
+    alignas(64) char buffer[Capacity];
+};
@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "backend.h"
+
+// Results of token lookups at the API, kept for auth_cache_ttl seconds in an
+// open-addressing hash table mapped before the worker processes are forked,
+// so that a client reconnecting with the same token skips the API whichever
+// worker accepts it. Entries are guarded by a sequence counter: readers retry
+// elsewhere rather than wait and a writer skips an entry another one holds.
+bool init_route_cache();
+bool lookup_route(const std::string &token, std::string &username, std::vector<Backend> &backends,
+    uint64_t &rate_limit);
+void store_route(const std::string &token, const std::string &username, const std::vector<Backend> &backends,
+    uint64_t rate_limit);
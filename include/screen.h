@@ -0,0 +1,98 @@
+#pragma once
+#include <vector>
+#include <freerdp/freerdp.h>
+#include <vterm.h>
+#include "tile.h"
+#include "encoder.h"
+#include "stats.h"
+
+// Receives what the greeter screen draws. RDPSession forwards it to the peer,
+// benchmarks count and drop it.
+class ScreenSink {
+public:
+    virtual ~ScreenSink() {}
+    virtual void begin_frame(uint32_t frame_id) = 0;
+    virtual void end_frame(uint32_t frame_id) = 0;
+    virtual void surface_bits(const SURFACE_BITS_COMMAND &cmd) = 0;
+    virtual void bitmap(const BITMAP_DATA &bitmap) = 0;
+    virtual void screen_blt(const SCRBLT_ORDER &order) = 0;
+};
+
+// What the client negotiated, taken from its settings on activation.
+struct ScreenCodecs {
+    bool remotefx;
+    bool nscodec;
+    bool screen_blt;
+    uint32_t color_depth;
+    // Whether planar bitmaps may leave out the alpha plane.
+    bool skip_alpha;
+    uint32_t remotefx_codec_id;
+    uint32_t nscodec_codec_id;
+};
+
+struct SplashFrame;
+
+// The greeter's terminal and its rendering: libvterm holds the cells, dirty
+// 64x64 tiles are rasterized from them on flush() and encoded to the sink.
+class GreeterScreen {
+public:
+    explicit GreeterScreen(ScreenSink &sink_);
+    ~GreeterScreen();
+    bool init(int width, int height);
+    void resize(int width, int height);
+    // Returns false if none of the client's codecs can be sent.
+    bool activate(const ScreenCodecs &codecs_);
+    void write(const char *data, size_t len);
+    void invalidate(int x, int y, int w, int h);
+    void flush();
+    VTerm *terminal() { return vt; }
+    int width() const { return screen_width; }
+    int height() const { return screen_height; }
+private:
+    static int screen_damage(VTermRect rect, void *user);
+    static int screen_move_cursor(VTermPos pos, VTermPos oldpos, int visible, void *user);
+    static int screen_move_rect(VTermRect dest, VTermRect src, void *user);
+    Encoder *acquire_encoder();
+    void release_encoder(Encoder *encoder);
+    TileCodec choose_codec(const uint32_t *pixels, int stride, int width, int height);
+    bool encode_tile(Encoder *encoder, const TileRect &tile, const uint32_t *pixels, int stride);
+    bool encode_surface_bits(Encoder *encoder, bool rfx, const TileRect &tile, const uint32_t *pixels, int stride);
+    bool encode_bitmap(Encoder *encoder, const TileRect &tile, const uint32_t *pixels, int stride);
+    void send_bitmap(const BITMAP_DATA &bitmap);
+    void send_surface_bits(const SURFACE_BITS_COMMAND &cmd);
+    void draw_splash();
+    void begin_frame();
+    void end_frame();
+    void damage(VTermRect rect);
+    void move_cursor(VTermPos pos, VTermPos oldpos, bool visible);
+    bool move_rect(VTermRect dest, VTermRect src);
+    TileRect cell_rect(VTermRect rect) const;
+    void mark_cells(VTermRect rect);
+    void mark_cursor();
+    uint32_t *render_tile(const TileRect &tile, uint32_t *scratch);
+    void render_cell(VTermPos pos, uint32_t *dst, int stride);
+
+    ScreenSink &sink;
+    ScreenCodecs codecs;
+    bool has_activated;
+    uint32_t rfx_frame_idx;
+    TileTracker tiles;
+    std::vector<TileRect> dirty_tiles;
+    SplashFrame *recording;
+    int screen_width;
+    int screen_height;
+    uint32_t frame_id;
+    VTerm *vt;
+    VTermScreen *vt_screen;
+    VTermState *vt_state;
+    VTermScreenCallbacks screen_callbacks;
+    int lines;
+    int cols;
+    VTermPos cursor_pos;
+    bool cursor_visible;
+    // Where the client last got the cursor drawn.
+    VTermPos drawn_cursor_pos;
+    bool drawn_cursor_visible;
+    int default_fg_color;
+    int default_bg_color;
+};
@@ -7,12 +7,34 @@
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/co_spawn.hpp>
 
+// One worker per thread, each with its own io_context and its own acceptor
+// bound to the same port with SO_REUSEPORT, so the kernel spreads connections
+// across workers and a session stays on the thread that accepted it. A worker
+// may hold more than one acceptor after taking over the listening sockets of
+// a previous process that ran more threads.
 class RDPProxyServer {
 public:
     RDPProxyServer();
+    // Returns once the server handed its sessions to a new process and drained.
     void run();
 private:
-    boost::asio::awaitable<void> accept_tcp();
-    boost::asio::io_context ioc;
-    std::unique_ptr<boost::asio::ip::tcp::acceptor> tcp_acceptor;
-};
\ No newline at end of file
+    struct Worker {
+        Worker() : ioc(1) {}
+        boost::asio::io_context ioc;
+        std::vector<std::unique_ptr<boost::asio::ip::tcp::acceptor>> acceptors;
+    };
+    void listen(Worker &worker);
+    bool adopt_listener(Worker &worker, int fd);
+    void stop_accepting();
+    void stop();
+    bool steer_by_cpu();
+    void pin_worker(size_t index);
+    boost::asio::awaitable<void> accept_tcp(Worker &worker, boost::asio::ip::tcp::acceptor &acceptor);
+    boost::asio::awaitable<void> report_statistics(boost::asio::io_context &ioc);
+    boost::asio::awaitable<void> reload_credentials(boost::asio::io_context &ioc);
+    boost::asio::awaitable<void> serve_upgrade(boost::asio::io_context &ioc, int fd);
+    boost::asio::awaitable<void> adopt_sessions(boost::asio::io_context &ioc, int fd);
+    boost::asio::awaitable<void> drain(boost::asio::io_context &ioc);
+    std::vector<std::unique_ptr<Worker>> workers;
+    bool cpu_steering;
+};
@@ -2,6 +2,7 @@
 #include <memory>
 #include <string>
 #include <tuple>
+#include <optional>
 #include <memory>
 #include <unordered_map>
 #include <unordered_set>
@@ -26,30 +27,75 @@
 #include <freerdp/server/rdpsnd.h>
 #include <vterm.h>
 #include <xkbcommon/xkbcommon.h>
+#include "screen.h"
+#include "ring.h"
+#include "backend.h"
+#include "registry.h"
+#include "throttle.h"
 
 class RDPSession;
 class Session: public std::enable_shared_from_this<Session> {
 public:
     Session(boost::asio::io_context &ioc_, boost::asio::ip::tcp::socket &socket);
+    // A session relayed by the previous process, from its two sockets.
+    Session(boost::asio::io_context &ioc_, int downstream, int upstream, const Backend &backend_,
+        uint64_t rate_limit_);
+    ~Session();
     void start();
+    void resume();
     void close();
+    // Ends the session from any thread: a relayed one is closed, a greeter's
+    // connection shut down so that its FreeRDP loop ends.
+    void kill();
+    // Sends every relayed session to the new process on fd once its relays
+    // reach a write boundary, and any session starting to relay afterwards.
+    // The sessions are sent from ioc's thread.
+    static void hand_off_all(boost::asio::io_context &ioc, int fd);
 private:
     using HandshakeResult = std::tuple<bool, bool, std::string, ssize_t>; // success, redirection, token, neg_req_offset
     boost::asio::awaitable<void> handle();
     boost::asio::awaitable<HandshakeResult> handshake(std::vector<uint8_t> &cr_pdu);
     boost::asio::awaitable<bool> read_x224_cr_pdu(std::string &cookie, std::vector<uint8_t> &buffer, ssize_t &neg_offset);
     boost::asio::awaitable<bool> peek_x224_cr_pdu(std::string &cookie, std::vector<uint8_t> &buffer, ssize_t &neg_offset);
-    boost::asio::awaitable<void> handle_up_to_down();
-    boost::asio::awaitable<void> handle_down_to_up();
+    void register_info(SessionMode mode);
+    void configure_relay_sockets();
+    void start_relay();
+    void spawn_relays();
+    void hand_off();
+    void finish_relay();
+    void finish_hand_off(bool sent);
+    static boost::asio::awaitable<void> send_handoffs();
+    boost::asio::awaitable<void> relay(boost::asio::ip::tcp::socket &from, boost::asio::ip::tcp::socket &to);
+    boost::asio::awaitable<bool> write_all(boost::asio::ip::tcp::socket &to, const uint8_t *data, size_t size);
+    boost::asio::awaitable<void> throttle(size_t size);
+    void account_throttle(ThrottleReason reason, std::chrono::steady_clock::time_point start);
+    boost::asio::awaitable<bool> connect_upstream(const std::vector<Backend> &candidates);
     boost::asio::io_context &ioc;
     boost::asio::ip::tcp::socket upstream_socket;
     boost::asio::ip::tcp::socket downstream_socket;
     std::unique_ptr<RDPSession> rdp;
     std::string ip;
+    std::optional<Backend> backend;
+    // The backend's rate limit while relaying with backend_rate_limit set.
+    BackendLimit *backend_limit;
     bool has_closed;
+    bool handing_off;
+    int active_relays;
+    bool framing;
+    // The API's cap on bytes/s toward the client, 0 for session_rate_limit.
+    uint64_t rate_limit;
+    bool throttling;
+    TokenBucket bucket;
+    RelayFlow flow;
+    SessionInfo info;
+    SessionShard *shard;
 };
 
-class RDPSession {
+// Carries the greeter's keystrokes from the session thread to the greeter
+// coroutine and its echo back.
+using GreeterRing = ByteRing<4096>;
+
+class RDPSession: private ScreenSink {
 public:
     RDPSession(int fd, boost::asio::io_context &ioc_);
     ~RDPSession();
@@ -57,63 +103,39 @@ public:
     void run(std::shared_ptr<Session> session);
 private:
     static BOOL rdp_context_new(freerdp_peer *peer_, rdpContext *ctx);
-    static void rdp_context_free(freerdp_peer *peer_, rdpContext *ctx);
     static BOOL rdp_post_connect(freerdp_peer* peer_);
     static BOOL rdp_activate(freerdp_peer* peer_);
     static BOOL rdp_keyboard_event(rdpInput* input, UINT16 flags, UINT16 code);
     static BOOL rdp_refresh_rect(rdpContext* context, BYTE count, const RECTANGLE_16* areas);
     static void terminal_output_callback(const char *s, size_t len, void *user);
-    static int screen_damage(VTermRect rect, void *user);
-    static int screen_move_cursor(VTermPos pos, VTermPos oldpos, int visible, void *user);
     bool context_new();
-    void context_free();
     bool post_connect();
     bool activate();
     bool keyboard_event(uint16_t flags, uint16_t code);
     bool refresh_rect(BYTE count, const RECTANGLE_16* areas);
-    bool draw_rect(int x, int y, int w, int h);
-    void begin_frame();
-    void end_frame();
-    void damage(VTermRect rect);
-    void move_cursor(VTermPos pos, VTermPos oldpos, bool visible);
-    void render_cursor(VTermPos pos);
-    void render_cell(VTermPos pos, bool reverse = false);
+    void begin_frame(uint32_t frame_id) override;
+    void end_frame(uint32_t frame_id) override;
+    void surface_bits(const SURFACE_BITS_COMMAND &cmd) override;
+    void bitmap(const BITMAP_DATA &bitmap) override;
+    void screen_blt(const SCRBLT_ORDER &order) override;
     void terminal_output(const char *s, size_t len);
-    void render_glyph(int x, int y, int width, uint32_t ch, uint32_t fg, uint32_t bg);
     void redirect();
     boost::asio::awaitable<void> greeter();
 
     int fd;
     freerdp_peer *peer;
     rdpContext *context;
-    RFX_CONTEXT *rfx;
-    NSC_CONTEXT *nsc;
-    wStream *stream;
     bool has_activated;
+    GreeterScreen screen;
     std::string token;
     std::string username;
     std::string password;
     std::string ip;
     std::string host_username;
-    std::vector<uint32_t> framebuffer;
-    int screen_width;
-    int screen_height;
-    int frame_id;
-    VTerm *vt;
-    VTermScreen *vt_screen;
-    VTermState *vt_state;
-    VTermScreenCallbacks screen_callbacks;
-    VTermStateCallbacks state_callbacks;
-    int lines;
-    int cols;
-    int in_pipe_fd[2];
-    int out_pipe_fd[2];
+    GreeterRing input;
+    GreeterRing output;
     int requested_width;
     int requested_height;
-    int default_fg_color;
-    int default_bg_color;
-    xkb_context *xkb_context_;
-    xkb_keymap *xkb_keymap_;
     xkb_state *xkb_state_;
     std::unordered_set<uint32_t> pressed_keys;
     bool has_authenticated;
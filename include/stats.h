@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <ostream>
+#include <inttypes.h>
+
+// Codecs a greeter tile can be sent with, indexes the per-codec counters.
+enum TileCodec {
+    CodecRemoteFX,
+    CodecNSCodec,
+    CodecPlanar,
+    CodecInterleaved,
+    CodecCount
+};
+
+// What a thread was doing when it allocated, indexes the allocation counters.
+enum AllocationPhase {
+    PhaseOther,
+    PhaseAccept,
+    PhaseHandshake,
+    PhaseConnect,
+    PhaseRelay,
+    PhaseGreeter,
+    PhaseCount
+};
+
+// Kinds of long-lived objects whose bytes are accounted, indexes memory_bytes.
+enum MemoryAccount {
+    MemorySessions,
+    MemoryRelayBuffers,
+    MemoryGreeters,
+    MemoryTerminals,
+    MemoryEncoders,
+    MemorySplashes,
+    MemoryCount
+};
+
+// What a relayed PDU carries, indexes the framing counters.
+enum PduClass {
+    PduControl,
+    PduInput,
+    PduGraphics,
+    PduBulk,
+    PduUnknown,
+    PduClassCount
+};
+
+// What a relay toward a client waited for, indexes the throttling counters.
+enum ThrottleReason {
+    ThrottleSession,
+    ThrottleBackend,
+    ThrottleLink,
+    ThrottleCount
+};
+
+struct Statistics {
+    std::atomic<uint64_t> tiles_encoded;
+    std::atomic<uint64_t> tiles_skipped;
+    std::atomic<uint64_t> encoder_pool_hits;
+    std::atomic<uint64_t> encoder_pool_misses;
+    std::atomic<uint64_t> encoder_pool_bytes_reused;
+    std::atomic<uint64_t> encoder_size;
+    std::atomic<uint64_t> codec_tiles[CodecCount];
+    std::atomic<uint64_t> codec_bytes[CodecCount];
+    std::atomic<uint64_t> codec_nanoseconds[CodecCount];
+    std::atomic<uint64_t> allocations[PhaseCount];
+    std::atomic<uint64_t> heap_allocations[PhaseCount];
+    // Bytes of small blocks (coroutine frames, Session objects, handlers...)
+    // in use, by the phase they were allocated in.
+    std::atomic<int64_t> live_bytes[PhaseCount];
+    std::atomic<int64_t> memory_bytes[MemoryCount];
+    std::atomic<uint64_t> tls_handshakes;
+    std::atomic<uint64_t> tls_resumed_handshakes;
+    std::atomic<uint64_t> tls_session_hits;
+    std::atomic<uint64_t> tls_session_misses;
+    std::atomic<uint64_t> tls_ticket_hits;
+    std::atomic<uint64_t> tls_ticket_misses;
+    std::atomic<uint64_t> tls_tickets_issued;
+    std::atomic<uint64_t> tls_ticket_key_rotations;
+    std::atomic<int64_t> live_sessions;
+    std::atomic<uint64_t> sessions_handed_off;
+    std::atomic<uint64_t> sessions_adopted;
+    std::atomic<uint64_t> route_cache_hits;
+    std::atomic<uint64_t> route_cache_misses;
+    std::atomic<uint64_t> relay_write_waits;
+    std::atomic<uint64_t> relay_pdus[PduClassCount];
+    std::atomic<uint64_t> relay_pdu_bytes[PduClassCount];
+    std::atomic<uint64_t> relay_bulk_yields;
+    std::atomic<uint64_t> throttled_writes[ThrottleCount];
+    std::atomic<uint64_t> throttled_nanoseconds[ThrottleCount];
+};
+
+extern Statistics statistics;
+
+void print_statistics(std::ostream &os, const Statistics &stats = statistics);
+// Adds the statistics of one worker process to those of the instance.
+void merge_statistics(Statistics &total, const Statistics &stats);
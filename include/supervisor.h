@@ -0,0 +1,8 @@
+#pragma once
+
+// Runs configuration.processes copies of the server, each its own process
+// with its own listening sockets on the port, and restarts those that crash.
+// Workers publish their counters to shared memory every second; the
+// supervisor prints their sum on SIGUSR1 and passes SIGHUP and SIGTERM on.
+// Returns once every worker exited.
+int supervise();
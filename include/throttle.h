@@ -0,0 +1,64 @@
+#pragma once
+#include <deque>
+#include <chrono>
+#include <inttypes.h>
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+
+// A rate in bytes/s that allows bursts of a tenth of a second or one relay
+// buffer. Senders take what they are about to send even beyond the balance
+// and wait until the debt is paid off, so the rate holds whatever the chunk
+// sizes. A rate of 0 is unlimited.
+class TokenBucket {
+public:
+    TokenBucket();
+    void set_rate(uint64_t rate_);
+    uint64_t get_rate() const;
+    // Takes size bytes, returns how long to wait before sending them.
+    std::chrono::nanoseconds take(size_t size);
+private:
+    uint64_t rate;
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+};
+
+// A relay waiting for its turn on a RelayScheduler. The timer is cancelled to
+// wake it up, by the scheduler or by the session closing.
+struct RelayFlow {
+    explicit RelayFlow(boost::asio::io_context &ioc);
+    boost::asio::steady_timer timer;
+    size_t request;
+    size_t deficit;
+    bool granted;
+    // Whether other flows or the process's bucket went first.
+    bool delayed;
+};
+
+// Shares rate_limit between the relays toward clients of one worker thread by
+// deficit round robin: each turn a waiting relay earns a quantum and sends its
+// chunk once its earnings cover it, so backlogged sessions get the same bytes/s
+// whatever their chunk sizes. Every thread's scheduler takes what it grants
+// from one bucket for the whole process.
+class RelayScheduler {
+public:
+    // The calling thread's scheduler.
+    static RelayScheduler &local(boost::asio::io_context &ioc);
+    // Queues flow to send size bytes; its timer is cancelled with granted set
+    // once it may.
+    void enqueue(RelayFlow &flow, size_t size);
+    void remove(RelayFlow &flow);
+    // Whether rate_limit is set, otherwise there is nothing to share.
+    static bool enabled();
+private:
+    explicit RelayScheduler(boost::asio::io_context &ioc_);
+    boost::asio::awaitable<void> run();
+    boost::asio::io_context &ioc;
+    boost::asio::steady_timer timer;
+    std::deque<RelayFlow *> active;
+    // Granted and waiting for the process's bucket.
+    RelayFlow *pending;
+    // Granted last, still backlogged if it queues again before the next turn.
+    // Only compared, it may be gone.
+    const RelayFlow *granting;
+    bool running;
+};
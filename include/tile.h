@@ -0,0 +1,45 @@
+#pragma once
+#include <vector>
+#include <inttypes.h>
+
+struct TileRect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+uint64_t hash_pixels(const uint32_t *pixels, int stride, int width, int height);
+
+// Tracks which 64x64 tiles of the screen changed since they were last sent.
+// Dirty tiles are collected, rendered by the caller and hashed, and tiles whose
+// hash equals the one sent previously are skipped. A hash is only recorded once
+// the caller reports the tile sent, so a tile that failed to encode is retried.
+class TileTracker {
+public:
+    static const int TileSize = 64;
+    TileTracker();
+    void reset(int width_, int height_);
+    void mark(int x, int y, int w, int h);
+    void mark_all();
+    void invalidate(int x, int y, int w, int h);
+    void overlapping(int x, int y, int w, int h, std::vector<TileRect> &tiles) const;
+    bool any_dirty(int x, int y, int w, int h) const;
+    void collect(std::vector<TileRect> &tiles);
+    bool changed(const TileRect &tile, const uint32_t *pixels, int stride, uint64_t &hash);
+    void sent(const TileRect &tile, uint64_t hash);
+    void retry(const TileRect &tile);
+    void sync(const TileRect &tile, const uint32_t *pixels, int stride);
+    const std::vector<uint64_t> &sent_hashes() const { return hashes; }
+    void restore(const std::vector<uint64_t> &hashes_);
+private:
+    bool clip(int &x1, int &y1, int &x2, int &y2) const;
+    TileRect tile_rect(int index) const;
+    int tile_index(const TileRect &tile) const;
+    int width;
+    int height;
+    int columns;
+    int rows;
+    std::vector<uint64_t> hashes;
+    std::vector<bool> dirty;
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <openssl/ssl.h>
+
+// The greeter's certificate chain, private key and DH parameters, read from
+// the configured files at startup and on SIGHUP. FreeRDP gets the PEM text
+// instead of file names, and every SSL_CTX it creates for a peer receives the
+// parsed intermediates and DH parameters from a hook, so no file is read per
+// connection.
+struct TlsCredentials {
+    TlsCredentials();
+    ~TlsCredentials();
+    TlsCredentials(const TlsCredentials &) = delete;
+    TlsCredentials &operator=(const TlsCredentials &) = delete;
+    std::string certificate_chain;
+    std::string private_key;
+    std::vector<X509 *> intermediates;
+    EVP_PKEY *dh_params;
+};
+
+bool load_tls_credentials();
+std::shared_ptr<const TlsCredentials> tls_credentials();
+// Registers the hook applying the credentials, the shared session cache and
+// the session ticket keys to new server SSL_CTXs.
+bool install_tls_hook();
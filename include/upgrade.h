@@ -0,0 +1,36 @@
+#pragma once
+#include <vector>
+#include <boost/asio.hpp>
+#include "backend.h"
+
+// A live upgrade hands the listening sockets and the relayed sessions of a
+// running rdpproxy to a newly started one over upgrade_socket, a Unix
+// SOCK_SEQPACKET socket. The new process connects and the old one answers
+// with one message carrying its listening sockets, then one per relayed
+// session carrying the client and backend sockets, the backend address and
+// the session's rate limit.
+// The old process closes the connection when it exits.
+struct HandoffSession {
+    int downstream;
+    int upstream;
+    Backend backend;
+    uint64_t rate_limit;
+};
+
+// Binds upgrade_socket for a later upgrade, replacing the previous
+// instance's, or returns -1.
+int listen_upgrade_socket();
+// Accepts the new process on upgrade_socket, or returns -1 if the connection
+// failed or comes from another user.
+int accept_upgrade_socket(int fd);
+// Connects to the instance being upgraded, or returns -1 if none listens.
+int connect_upgrade_socket();
+bool send_listeners(int fd, const std::vector<int> &listeners);
+bool receive_listeners(int fd, std::vector<int> &listeners);
+// 1 once sent, 0 if the new process has not read enough yet and it would
+// block, -1 on error.
+int send_session(int fd, const HandoffSession &session);
+// 1 with a session, 0 if none is pending, -1 once the old process is gone.
+int receive_session(int fd, HandoffSession &session);
+// TCP over IPv4 or IPv6, as the socket was created.
+boost::asio::ip::tcp socket_protocol(int fd);
@@ -0,0 +1,192 @@
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "admin.h"
+#include "session.h"
+#include "registry.h"
+#include "backend.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace std;
+using uds = boost::asio::local::stream_protocol; // UDS = Unix Domain Socket
+
+extern Configuration configuration;
+
+static const char *const ModeNames[] = { "handshake", "greeter", "relay" };
+
+struct SessionRow {
+    uint64_t id;
+    string ip;
+    int mode;
+    string backend;
+    uint64_t token_hash;
+    int64_t age;
+    uint64_t bytes[DirectionCount];
+    uint64_t rates[DirectionCount];
+    uint64_t throttled_ms;
+};
+
+static vector<SessionRow> session_rows() {
+    vector<SessionRow> rows;
+    auto now = chrono::steady_clock::now();
+    session_registry.for_each([&rows, now](SessionInfo &info) {
+        SessionRow row;
+        row.id = info.id;
+        row.ip = info.ip;
+        row.mode = info.mode.load(memory_order_acquire);
+        row.backend = row.mode == ModeRelay ? info.backend : "-";
+        row.token_hash = row.mode == ModeRelay ? info.token_hash : 0;
+        row.age = chrono::duration_cast<chrono::seconds>(now - info.created).count();
+        for (int i = 0; i < DirectionCount; i++) {
+            row.bytes[i] = info.bytes[i].load(memory_order_relaxed);
+            row.rates[i] = info.rates[i];
+        }
+        row.throttled_ms = info.throttled_nanoseconds.load(memory_order_relaxed) / 1000000;
+        rows.push_back(move(row));
+    });
+    return rows;
+}
+
+static void print_rows(ostream &os, const vector<SessionRow> &rows) {
+    os << "id ip mode backend token age up_bytes down_bytes up_rate down_rate throttled_ms\n";
+    for (const SessionRow &row : rows) {
+        os << row.id << " " << row.ip << " " << ModeNames[row.mode] << " " << row.backend << " ";
+        if (row.token_hash) {
+            os << hex << row.token_hash << dec;
+        } else {
+            os << "-";
+        }
+        os << " " << row.age << " " << row.bytes[DirectionUp] << " " << row.bytes[DirectionDown]
+            << " " << row.rates[DirectionUp] << " " << row.rates[DirectionDown] << " " << row.throttled_ms << "\n";
+    }
+}
+
+static bool kill_session(uint64_t id) {
+    shared_ptr<Session> target;
+    session_registry.for_each([&target, id](SessionInfo &info) {
+        if (info.id == id) {
+            target = info.session->weak_from_this().lock();
+        }
+    });
+    if (!target) {
+        return false;
+    }
+    target->kill();
+    return true;
+}
+
+static void run_command(const string &line, ostream &os) {
+    istringstream iss(line);
+    string command;
+    iss >> command;
+    if (command == "sessions") {
+        vector<SessionRow> rows = session_rows();
+        sort(rows.begin(), rows.end(), [](const SessionRow &a, const SessionRow &b) {
+            return a.id < b.id;
+        });
+        print_rows(os, rows);
+    } else if (command == "top") {
+        size_t count = 10;
+        iss >> count;
+        vector<SessionRow> rows = session_rows();
+        rows.erase(remove_if(rows.begin(), rows.end(), [](const SessionRow &row) {
+            return row.mode != ModeRelay;
+        }), rows.end());
+        sort(rows.begin(), rows.end(), [](const SessionRow &a, const SessionRow &b) {
+            return a.rates[DirectionUp] + a.rates[DirectionDown] > b.rates[DirectionUp] + b.rates[DirectionDown];
+        });
+        rows.resize(min(rows.size(), count));
+        print_rows(os, rows);
+    } else if (command == "kill") {
+        uint64_t id;
+        if (!(iss >> id)) {
+            os << "usage: kill ID\n";
+        } else if (kill_session(id)) {
+            os << "ok\n";
+        } else {
+            os << "no such session\n";
+        }
+    } else if (command == "stats") {
+        print_statistics(os);
+    } else if (command == "backends") {
+        os << "backend healthy active_relays connects connect_failures fast_failures probes probe_failures\n";
+        for (const BackendStats &s : backend_registry.stats()) {
+            os << s.backend.ip << ":" << s.backend.port << " " << s.healthy << " " << s.active_relays
+                << " " << s.connects << " " << s.connect_failures << " " << s.fast_failures
+                << " " << s.probes << " " << s.probe_failures << "\n";
+        }
+    } else {
+        os << "commands: sessions, top N, kill ID, stats, backends\n";
+    }
+}
+
+// Turns the byte counters into bytes/s once a second. Only this thread
+// touches the sampled values.
+static boost::asio::awaitable<void> sample_rates(boost::asio::io_context &ioc) {
+    boost::asio::steady_timer timer(ioc);
+    while (true) {
+        timer.expires_after(chrono::seconds(1));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        session_registry.for_each([](SessionInfo &info) {
+            for (int i = 0; i < DirectionCount; i++) {
+                uint64_t bytes = info.bytes[i].load(memory_order_relaxed);
+                info.rates[i] = bytes - info.sampled_bytes[i];
+                info.sampled_bytes[i] = bytes;
+            }
+        });
+    }
+}
+
+static boost::asio::awaitable<void> serve_client(uds::socket socket) {
+    boost::asio::streambuf buffer;
+    try {
+        while (true) {
+            size_t length = co_await boost::asio::async_read_until(socket, buffer, '\n',
+                boost::asio::use_awaitable);
+            string line(boost::asio::buffers_begin(buffer.data()),
+                boost::asio::buffers_begin(buffer.data()) + length - 1);
+            buffer.consume(length);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            ostringstream os;
+            run_command(line, os);
+            os << "\n";
+            string response = os.str();
+            co_await boost::asio::async_write(socket, boost::asio::buffer(response), boost::asio::use_awaitable);
+        }
+    } catch (std::exception &e) {
+    }
+}
+
+boost::asio::awaitable<void> serve_admin(boost::asio::io_context &ioc) {
+    unlink(configuration.admin_socket.c_str());
+    uds::acceptor acceptor(ioc);
+    boost::system::error_code ec;
+    acceptor.open(uds(), ec);
+    if (!ec) {
+        // Whoever can connect can end sessions, so the socket is created
+        // accessible to our user only.
+        mode_t mask = umask(077);
+        acceptor.bind(uds::endpoint(configuration.admin_socket), ec);
+        umask(mask);
+    }
+    if (!ec) {
+        acceptor.listen(boost::asio::socket_base::max_listen_connections, ec);
+    }
+    if (ec) {
+        cerr << "Cannot listen on admin_socket.\n";
+        co_return;
+    }
+    boost::asio::co_spawn(ioc, [&ioc] { return sample_rates(ioc); }, boost::asio::detached);
+    while (true) {
+        uds::socket socket = co_await acceptor.async_accept(boost::asio::use_awaitable);
+        boost::asio::co_spawn(ioc, serve_client(move(socket)), boost::asio::detached);
+    }
+}
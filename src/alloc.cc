@@ -0,0 +1,166 @@
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+#include "alloc.h"
+
+using namespace std;
+
+// Blocks carry a header with their size class, the phase they were allocated
+// in and their size, aligned like malloc's result.
+struct BlockHeader {
+    uint32_t size_class;
+    uint32_t phase;
+    size_t size;
+};
+
+static const size_t HeaderSize = alignof(max_align_t);
+static_assert(sizeof(BlockHeader) <= HeaderSize, "block header does not fit");
+static const size_t Granularity = 32;
+static const size_t ClassCount = 64;
+static const size_t MaxSize = Granularity * ClassCount;
+static const uint32_t LargeClass = ClassCount;
+// Cached bytes per size class and thread, beyond which freed blocks go back to malloc.
+static const size_t MaxCachedBytes = 256 * 1024;
+// Counters are published in batches to keep the shared atomics off the fast path.
+static const uint32_t PublishInterval = 256;
+static const int64_t PublishBytes = 64 * 1024;
+
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+// Plain thread_local data, usable until the very end of the thread. The
+// destructor of ThreadCacheGuard returns the cached blocks and turns caching
+// off for whatever the thread frees afterwards.
+static thread_local FreeBlock *free_lists[ClassCount];
+static thread_local uint32_t free_counts[ClassCount];
+static thread_local bool cache_enabled;
+static thread_local AllocationPhase current_phase;
+static thread_local uint32_t pending_allocations[PhaseCount];
+static thread_local uint32_t pending_heap_allocations[PhaseCount];
+static thread_local int64_t pending_live_bytes[PhaseCount];
+
+struct ThreadCacheGuard {
+    ThreadCacheGuard() {
+        cache_enabled = true;
+    }
+    ~ThreadCacheGuard() {
+        cache_enabled = false;
+        for (size_t i = 0; i < ClassCount; i++) {
+            while (free_lists[i]) {
+                FreeBlock *block = free_lists[i];
+                free_lists[i] = block->next;
+                free((char *)block - HeaderSize);
+            }
+            free_counts[i] = 0;
+        }
+    }
+};
+
+static thread_local ThreadCacheGuard cache_guard;
+
+void set_allocation_phase(AllocationPhase phase) {
+    current_phase = phase;
+}
+
+static void count_allocation(bool heap) {
+    if (++pending_allocations[current_phase] == PublishInterval) {
+        statistics.allocations[current_phase] += PublishInterval;
+        pending_allocations[current_phase] = 0;
+    }
+    if (heap && ++pending_heap_allocations[current_phase] == PublishInterval) {
+        statistics.heap_allocations[current_phase] += PublishInterval;
+        pending_heap_allocations[current_phase] = 0;
+    }
+}
+
+static void count_live_bytes(uint32_t phase, int64_t bytes) {
+    int64_t &pending = pending_live_bytes[phase];
+    pending += bytes;
+    if (pending >= PublishBytes || pending <= -PublishBytes) {
+        statistics.live_bytes[phase] += pending;
+        pending = 0;
+    }
+}
+
+static void *allocate(size_t size) {
+    uint32_t size_class = size <= MaxSize ? (size + Granularity - 1) / Granularity : LargeClass;
+    if (size_class == 0) {
+        size_class = 1;
+    }
+    if (size_class != LargeClass) {
+        // Index 0 holds the 32-byte class.
+        size_t index = size_class - 1;
+        FreeBlock *block = free_lists[index];
+        if (block) {
+            free_lists[index] = block->next;
+            free_counts[index]--;
+            BlockHeader *header = (BlockHeader *)((char *)block - HeaderSize);
+            header->phase = current_phase;
+            count_allocation(false);
+            count_live_bytes(current_phase, header->size);
+            return block;
+        }
+        size = size_class * Granularity;
+    }
+    char *p = size <= SIZE_MAX - HeaderSize ? (char *)malloc(HeaderSize + size) : nullptr;
+    if (!p) {
+        throw bad_alloc();
+    }
+    BlockHeader *header = (BlockHeader *)p;
+    header->size_class = size_class;
+    header->phase = current_phase;
+    header->size = size;
+    // Touches cache_guard so that its destructor is registered for this thread.
+    if (size_class != LargeClass && !cache_enabled) {
+        (void)&cache_guard;
+    }
+    count_allocation(true);
+    count_live_bytes(current_phase, size);
+    return p + HeaderSize;
+}
+
+static void deallocate(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    char *p = (char *)ptr - HeaderSize;
+    BlockHeader *header = (BlockHeader *)p;
+    uint32_t size_class = header->size_class;
+    count_live_bytes(header->phase, -(int64_t)header->size);
+    if (size_class != LargeClass && cache_enabled) {
+        size_t index = size_class - 1;
+        if (free_counts[index] * size_class * Granularity < MaxCachedBytes) {
+            FreeBlock *block = (FreeBlock *)ptr;
+            block->next = free_lists[index];
+            free_lists[index] = block;
+            free_counts[index]++;
+            return;
+        }
+    }
+    free(p);
+}
+
+void *operator new(size_t size) {
+    return allocate(size);
+}
+
+void *operator new[](size_t size) {
+    return allocate(size);
+}
+
+void operator delete(void *p) noexcept {
+    deallocate(p);
+}
+
+void operator delete[](void *p) noexcept {
+    deallocate(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    deallocate(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    deallocate(p);
+}
@@ -3,6 +3,7 @@
 #include "nlohmann/json.hpp"
 #include "auth.h"
 #include "config.h"
+#include "route_cache.h"
 
 using namespace std;
 
@@ -13,7 +14,10 @@ using json = nlohmann::json;
 extern Configuration configuration;
 
 boost::asio::awaitable<bool> auth(const string &token, string &username,
-    string &ip, uint16_t &port, boost::asio::io_context &ioc) {
+    vector<Backend> &backends, uint64_t &rate_limit, boost::asio::io_context &ioc) {
+    if (lookup_route(token, username, backends, rate_limit)) {
+        co_return true;
+    }
     beast::http::request<beast::http::string_body> http_req;
     beast::http::response<beast::http::string_body> http_res;
     tcp::socket http_socket(ioc);
@@ -54,15 +58,27 @@ boost::asio::awaitable<bool> auth(const string &token, string &username,
         if (status != "ok") {
             co_return false;
         }
-        ip = body["ip"].get<string>();
-        port = body["port"].get<uint16_t>();
-        auto it = body.find("username");
+        backends.clear();
+        auto it = body.find("backends");
+        if (it != body.end()) {
+            for (const json &backend : *it) {
+                backends.push_back({ backend.at("ip").get<string>(), backend.at("port").get<uint16_t>() });
+            }
+        } else {
+            backends.push_back({ body["ip"].get<string>(), body["port"].get<uint16_t>() });
+        }
+        if (backends.empty()) {
+            co_return false;
+        }
+        it = body.find("username");
         if (it != body.end()) {
             username = body["username"].get<string>();
         }
+        rate_limit = body.value("rate_limit", (uint64_t)0);
     } catch (json::exception &e) {
         co_return false;
     }
+    store_route(token, username, backends, rate_limit);
     co_return true;
 }
 
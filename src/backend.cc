@@ -0,0 +1,193 @@
+#include <memory>
+#include <algorithm>
+#include "backend.h"
+#include "config.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+extern Configuration configuration;
+
+BackendRegistry backend_registry;
+
+chrono::nanoseconds BackendLimit::take(size_t size) {
+    lock_guard<std::mutex> lock(mutex);
+    return bucket.take(size);
+}
+
+BackendRegistry::BackendRegistry() : rng(random_device()()) {}
+
+// Requires the lock. States are kept for the lifetime of the process, there
+// are only as many as the API has backends.
+BackendRegistry::BackendState &BackendRegistry::state(const Backend &backend) {
+    string key = backend.ip + ":" + to_string(backend.port);
+    auto it = states.find(key);
+    if (it == states.end()) {
+        BackendState state = { backend };
+        // backend_rate_limit is for the whole instance, each worker process
+        // takes its share like for rate_limit.
+        state.limit = make_unique<BackendLimit>();
+        if (configuration.backend_rate_limit > 0) {
+            state.limit->bucket.set_rate(max<uint64_t>(configuration.backend_rate_limit / configuration.processes, 1));
+        }
+        it = states.emplace(key, move(state)).first;
+    }
+    return it->second;
+}
+
+vector<Backend> BackendRegistry::order(const vector<Backend> &candidates) {
+    lock_guard<std::mutex> lock(mutex);
+    vector<tuple<bool, int, size_t>> loads;
+    loads.reserve(candidates.size());
+    for (size_t i = 0; i < candidates.size(); i++) {
+        BackendState &s = state(candidates[i]);
+        loads.emplace_back(s.open, s.active_relays, i);
+    }
+    // Ties keep the order the API returned them in.
+    stable_sort(loads.begin(), loads.end(),
+        [](const tuple<bool, int, size_t> &a, const tuple<bool, int, size_t> &b) {
+            return make_pair(get<0>(a), get<1>(a)) < make_pair(get<0>(b), get<1>(b));
+        });
+    size_t healthy = count_if(loads.begin(), loads.end(),
+        [](const tuple<bool, int, size_t> &load) { return !get<0>(load); });
+    if (configuration.backend_two_choices && healthy > 2) {
+        // Power of two choices: the less loaded of two random candidates goes
+        // first, so proxies sharing a pool of backends don't all pile onto the
+        // same least loaded one between two API responses.
+        uniform_int_distribution<size_t> pick(0, healthy - 1);
+        size_t a = pick(rng);
+        size_t b = pick(rng);
+        while (b == a) {
+            b = pick(rng);
+        }
+        rotate(loads.begin(), loads.begin() + min(a, b), loads.begin() + min(a, b) + 1);
+    }
+    vector<Backend> ordered;
+    ordered.reserve(loads.size());
+    for (const auto &load : loads) {
+        ordered.push_back(candidates[get<2>(load)]);
+    }
+    return ordered;
+}
+
+bool BackendRegistry::admit(const Backend &backend) {
+    lock_guard<std::mutex> lock(mutex);
+    BackendState &s = state(backend);
+    if (!s.open) {
+        return true;
+    }
+    if (!s.trial && chrono::steady_clock::now() >= s.open_until) {
+        s.trial = true;
+        return true;
+    }
+    s.fast_failures++;
+    return false;
+}
+
+void BackendRegistry::report(const Backend &backend, bool success, bool probe) {
+    lock_guard<std::mutex> lock(mutex);
+    BackendState &s = state(backend);
+    if (probe) {
+        s.probes++;
+    } else {
+        s.connects++;
+    }
+    if (success) {
+        s.failures = 0;
+        s.open = false;
+        s.trial = false;
+        return;
+    }
+    if (probe) {
+        s.probe_failures++;
+    } else {
+        s.connect_failures++;
+    }
+    s.failures++;
+    if (s.open || s.failures >= (int)configuration.backend_failure_threshold) {
+        s.open = true;
+        s.trial = false;
+        s.open_until = chrono::steady_clock::now() + chrono::milliseconds(configuration.backend_open_time);
+    }
+}
+
+void BackendRegistry::acquire(const Backend &backend) {
+    lock_guard<std::mutex> lock(mutex);
+    state(backend).active_relays++;
+}
+
+void BackendRegistry::release(const Backend &backend) {
+    lock_guard<std::mutex> lock(mutex);
+    state(backend).active_relays--;
+}
+
+BackendLimit *BackendRegistry::limit(const Backend &backend) {
+    lock_guard<std::mutex> lock(mutex);
+    return state(backend).limit.get();
+}
+
+vector<Backend> BackendRegistry::unhealthy() {
+    lock_guard<std::mutex> lock(mutex);
+    vector<Backend> backends;
+    for (const auto &entry : states) {
+        if (entry.second.open) {
+            backends.push_back(entry.second.backend);
+        }
+    }
+    return backends;
+}
+
+vector<BackendStats> BackendRegistry::stats() {
+    lock_guard<std::mutex> lock(mutex);
+    vector<BackendStats> result;
+    result.reserve(states.size());
+    for (const auto &entry : states) {
+        const BackendState &s = entry.second;
+        result.push_back({ s.backend, !s.open, s.active_relays, s.connects, s.connect_failures,
+            s.fast_failures, s.probes, s.probe_failures });
+    }
+    return result;
+}
+
+boost::asio::awaitable<boost::system::error_code> connect_backend(
+    tcp::socket &socket, const Backend &backend, uint32_t timeout) {
+    boost::system::error_code ec;
+    boost::asio::ip::address address = boost::asio::ip::make_address(backend.ip, ec);
+    if (ec) {
+        co_return ec;
+    }
+    // No per-operation cancellation in this Asio: the timer cancels the socket
+    // instead, which fails the pending connect. The timer may expire together
+    // with the connect and its handler run after we returned, when the socket
+    // may be gone or busy with other operations, so it only touches the socket
+    // while the connect is pending and the caller waits here.
+    auto done = make_shared<bool>(false);
+    boost::asio::steady_timer timer(socket.get_executor(), chrono::milliseconds(timeout));
+    timer.async_wait([&socket, done](const boost::system::error_code &error) {
+        if (!error && !*done) {
+            boost::system::error_code ignored;
+            socket.cancel(ignored);
+        }
+    });
+    co_await socket.async_connect(tcp::endpoint(address, backend.port),
+        boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    *done = true;
+    timer.cancel();
+    co_return ec;
+}
+
+boost::asio::awaitable<void> probe_backends(boost::asio::io_context &ioc) {
+    boost::asio::steady_timer timer(ioc);
+    while (true) {
+        timer.expires_after(chrono::milliseconds(configuration.backend_probe_interval));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+        for (const Backend &backend : backend_registry.unhealthy()) {
+            tcp::socket socket(ioc);
+            boost::system::error_code ec = co_await connect_backend(socket, backend,
+                configuration.backend_connect_timeout);
+            backend_registry.report(backend, !ec, true);
+            boost::system::error_code ignored;
+            socket.close(ignored);
+        }
+    }
+}
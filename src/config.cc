@@ -1,4 +1,5 @@
 #include <string>
+#include <thread>
 #include <fstream>
 #include <iostream>
 #include "nlohmann/json.hpp"
@@ -59,6 +60,48 @@ bool load_configuration(const string &filename, Configuration &config) {
         config.cert_chain_file = config_json["cert_chain_file"].get<string>();
         config.private_key_file = config_json["private_key_file"].get<string>();
         config.dhparam_file = config_json["dhparam_file"].get<string>();
+        config.tls_session_cache_size = config_json.value("tls_session_cache_size", 20000);
+        config.tls_session_timeout = max(config_json.value("tls_session_timeout", 3600), 1);
+        config.threads = max(config_json.value("threads", thread::hardware_concurrency()), 1u);
+        config.pending_accepts = max(config_json.value("pending_accepts", 4u), 1u);
+        config.defer_accept = config_json.value("defer_accept", 5);
+        config.reuseport_cpu = config_json.value("reuseport_cpu", false);
+        config.encoder_pool_size = config_json.value("encoder_pool_size",
+            4 * max(thread::hardware_concurrency(), 1u));
+        config.max_desktop_width = config_json.value("max_desktop_width", 1920);
+        config.max_desktop_height = config_json.value("max_desktop_height", 1080);
+        string backend_selection = config_json.value("backend_selection", "least_relays");
+        if (backend_selection == "two_choices") {
+            config.backend_two_choices = true;
+        } else if (backend_selection == "least_relays") {
+            config.backend_two_choices = false;
+        } else {
+            cerr << "Cannot parse configuration file: unknown backend_selection.\n";
+            return false;
+        }
+        config.backend_connect_timeout = config_json.value("backend_connect_timeout", 3000);
+        config.backend_failure_threshold = max(config_json.value("backend_failure_threshold", 3), 1);
+        config.backend_open_time = config_json.value("backend_open_time", 10000);
+        config.backend_probe_interval = config_json.value("backend_probe_interval", 0);
+        config.upgrade_socket = config_json.value("upgrade_socket", "");
+        config.upgrade_drain_timeout = config_json.value("upgrade_drain_timeout", 3600);
+        config.processes = max(config_json.value("processes", 1u), 1u);
+        // The CPU program indexes the sockets of the whole reuseport group,
+        // whose order across processes is that of their binds.
+        if (config.reuseport_cpu && config.processes > 1) {
+            cerr << "Cannot parse configuration file: reuseport_cpu needs a single process.\n";
+            return false;
+        }
+        config.auth_cache_size = max(config_json.value("auth_cache_size", 4096u), 1u);
+        config.auth_cache_ttl = config_json.value("auth_cache_ttl", 0);
+        config.admin_socket = config_json.value("admin_socket", "");
+        config.relay_notsent_lowat = config_json.value("relay_notsent_lowat", 0);
+        config.relay_send_buffer = config_json.value("relay_send_buffer", 0);
+        config.relay_receive_buffer = config_json.value("relay_receive_buffer", 0);
+        config.relay_framing = config_json.value("relay_framing", false);
+        config.rate_limit = config_json.value("rate_limit", (uint64_t)0);
+        config.session_rate_limit = config_json.value("session_rate_limit", (uint64_t)0);
+        config.backend_rate_limit = config_json.value("backend_rate_limit", (uint64_t)0);
     } catch (json::exception &e) {
         cerr << "Cannot parse configuration file: invalid JSON file.\n";
         return false;
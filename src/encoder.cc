@@ -0,0 +1,142 @@
+#include <malloc.h>
+#include "encoder.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace std;
+
+extern Configuration configuration;
+
+EncoderPool encoder_pool;
+
+static size_t heap_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+EncoderPool::EncoderPool() : encoder_size(0) {}
+
+EncoderPool::~EncoderPool() {
+    for (Encoder *encoder : idle) {
+        destroy(encoder);
+    }
+}
+
+Encoder *EncoderPool::create() {
+    Encoder *encoder = new Encoder();
+    encoder->rfx = rfx_context_new(true);
+    if (!encoder->rfx) {
+        destroy(encoder);
+        return nullptr;
+    }
+    encoder->rfx->mode = RLGR3;
+    rfx_context_set_pixel_format(encoder->rfx, PIXEL_FORMAT_BGRA32);
+    encoder->nsc = nsc_context_new();
+    if (!encoder->nsc) {
+        destroy(encoder);
+        return nullptr;
+    }
+    if (!nsc_context_set_parameters(encoder->nsc, NSC_COLOR_FORMAT, PIXEL_FORMAT_BGRA32)) {
+        destroy(encoder);
+        return nullptr;
+    }
+    // Planar and interleaved bitmaps are only used for single tiles.
+    encoder->planar = freerdp_bitmap_planar_context_new(
+        PLANAR_FORMAT_HEADER_RLE | PLANAR_FORMAT_HEADER_NA, 64, 64);
+    if (!encoder->planar) {
+        destroy(encoder);
+        return nullptr;
+    }
+    encoder->planar_alpha = freerdp_bitmap_planar_context_new(PLANAR_FORMAT_HEADER_RLE, 64, 64);
+    if (!encoder->planar_alpha) {
+        destroy(encoder);
+        return nullptr;
+    }
+    encoder->interleaved = bitmap_interleaved_context_new(TRUE);
+    if (!encoder->interleaved) {
+        destroy(encoder);
+        return nullptr;
+    }
+    encoder->stream = Stream_New(nullptr, 65536);
+    if (!encoder->stream) {
+        destroy(encoder);
+        return nullptr;
+    }
+    return encoder;
+}
+
+void EncoderPool::destroy(Encoder *encoder) {
+    if (encoder->stream) {
+        Stream_Free(encoder->stream, true);
+    }
+    if (encoder->rfx) {
+        rfx_context_free(encoder->rfx);
+    }
+    if (encoder->nsc) {
+        nsc_context_free(encoder->nsc);
+    }
+    if (encoder->planar) {
+        freerdp_bitmap_planar_context_free(encoder->planar);
+    }
+    if (encoder->planar_alpha) {
+        freerdp_bitmap_planar_context_free(encoder->planar_alpha);
+    }
+    if (encoder->interleaved) {
+        bitmap_interleaved_context_free(encoder->interleaved);
+    }
+    statistics.memory_bytes[MemoryEncoders] -= encoder->footprint;
+    delete encoder;
+}
+
+// Hands out an encoder reset for a new client, so a RemoteFX context sends the
+// codec headers again and starts from frame 0.
+Encoder *EncoderPool::acquire(int width, int height) {
+    Encoder *encoder = nullptr;
+    {
+        lock_guard<std::mutex> lock(mutex);
+        if (!idle.empty()) {
+            encoder = idle.back();
+            idle.pop_back();
+        }
+    }
+    if (encoder) {
+        ++statistics.encoder_pool_hits;
+        statistics.encoder_pool_bytes_reused += encoder_size;
+    } else {
+        ++statistics.encoder_pool_misses;
+        size_t heap_before = heap_in_use();
+        encoder = create();
+        if (!encoder) {
+            return nullptr;
+        }
+        // Approximate: allocations by other threads in between are counted too.
+        size_t heap_after = heap_in_use();
+        if (heap_after > heap_before) {
+            encoder_size = heap_after - heap_before;
+            statistics.encoder_size = encoder_size.load();
+        }
+        encoder->footprint = encoder_size;
+        statistics.memory_bytes[MemoryEncoders] += encoder->footprint;
+    }
+    if (!rfx_context_reset(encoder->rfx, width, height) ||
+        !nsc_context_reset(encoder->nsc, width, height)) {
+        destroy(encoder);
+        return nullptr;
+    }
+    Stream_SetPosition(encoder->stream, 0);
+    return encoder;
+}
+
+void EncoderPool::release(Encoder *encoder) {
+    if (!encoder) {
+        return;
+    }
+    {
+        lock_guard<std::mutex> lock(mutex);
+        if (idle.size() < configuration.encoder_pool_size) {
+            idle.push_back(encoder);
+            return;
+        }
+    }
+    destroy(encoder);
+}
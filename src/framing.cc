@@ -0,0 +1,112 @@
+#include <algorithm>
+#include "framing.h"
+
+using namespace std;
+
+static const uint8_t TpktVersion = 0x03;
+static const size_t TpktHeaderSize = 4;
+static const uint8_t FastPathActionMask = 0x03;
+static const uint8_t FastPathAction = 0x00;
+static const uint8_t FastPathLongLength = 0x80;
+static const uint8_t TlsChangeCipherSpec = 0x14;
+static const uint8_t TlsHandshake = 0x16;
+static const uint8_t TlsApplicationData = 0x17;
+static const uint8_t TlsMajorVersion = 0x03;
+static const size_t TlsHeaderSize = 5;
+// Keyboard and mouse events take a few dozen bytes once encrypted, screen
+// updates and channel data from the client far more.
+static const size_t InputRecordSize = 256;
+
+PduFramer::PduFramer(bool from_client_) : from_client(from_client_), mode(FramingRdp), header_size(0),
+    remaining(0), current(PduUnknown), bytes(), pdus() {}
+
+// How much of the header gives the PDU's length, 0 if the first byte starts
+// no PDU known here.
+size_t PduFramer::header_size_needed() const {
+    if (mode == FramingTls || header[0] == TlsHandshake) {
+        return TlsHeaderSize;
+    }
+    if (header[0] == TpktVersion) {
+        return TpktHeaderSize;
+    }
+    if ((header[0] & FastPathActionMask) == FastPathAction) {
+        return header_size >= 2 && (header[1] & FastPathLongLength) ? 3 : 2;
+    }
+    return 0;
+}
+
+void PduFramer::start_pdu() {
+    size_t length;
+    PduClass pdu_class;
+    if (mode == FramingTls || header[0] == TlsHandshake) {
+        length = TlsHeaderSize + (header[3] << 8 | header[4]);
+        if (header[1] != TlsMajorVersion || header[0] < TlsChangeCipherSpec || header[0] > TlsApplicationData) {
+            length = 0;
+        }
+        mode = FramingTls;
+        if (header[0] != TlsApplicationData) {
+            pdu_class = PduControl;
+        } else if (!from_client) {
+            pdu_class = PduGraphics;
+        } else {
+            pdu_class = length <= InputRecordSize ? PduInput : PduBulk;
+        }
+    } else if (header[0] == TpktVersion) {
+        length = header[2] << 8 | header[3];
+        pdu_class = PduControl;
+    } else {
+        length = header[1] & FastPathLongLength ? (header[1] & ~FastPathLongLength) << 8 | header[2] : header[1];
+        pdu_class = from_client ? PduInput : PduGraphics;
+    }
+    if (length < header_size) {
+        mode = FramingLost;
+        pdu_class = PduUnknown;
+        length = header_size;
+    }
+    pdus[pdu_class]++;
+    bytes[pdu_class] += header_size;
+    remaining = length - header_size;
+    current = pdu_class;
+    header_size = 0;
+}
+
+size_t PduFramer::consume(const uint8_t *data, size_t size) {
+    uint64_t input = bytes[PduInput];
+    const uint8_t *end = data + size;
+    while (data < end) {
+        if (remaining > 0) {
+            size_t n = min<size_t>(remaining, end - data);
+            bytes[current] += n;
+            remaining -= n;
+            data += n;
+        } else if (mode == FramingLost) {
+            bytes[PduUnknown] += end - data;
+            break;
+        } else {
+            // Headers are a few bytes and may be split across reads.
+            header[header_size++] = *data++;
+            size_t needed = header_size_needed();
+            if (needed == 0) {
+                mode = FramingLost;
+                bytes[PduUnknown] += header_size;
+                header_size = 0;
+            } else if (header_size == needed) {
+                start_pdu();
+            }
+        }
+    }
+    return size - (bytes[PduInput] - input);
+}
+
+void PduFramer::publish() {
+    for (int i = 0; i < PduClassCount; i++) {
+        if (pdus[i] > 0) {
+            statistics.relay_pdus[i] += pdus[i];
+            pdus[i] = 0;
+        }
+        if (bytes[i] > 0) {
+            statistics.relay_pdu_bytes[i] += bytes[i];
+            bytes[i] = 0;
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#include "glyph.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_X86_KERNELS
+#endif
+
+using namespace std;
+
+// Bit j of a bitmap row selects the foreground color for pixel j.
+template <int Width>
+static void rasterize_scalar(const uint16_t *bitmap, uint32_t *dst, int stride, uint32_t fg, uint32_t bg) {
+    for (int i = 0; i < GlyphHeight; ++i) {
+        uint32_t line = bitmap[i];
+        uint32_t *row = dst + (size_t)i * stride;
+        for (int j = 0; j < Width; ++j) {
+            uint32_t mask = -((line >> j) & 1);
+            row[j] = (fg & mask) | (bg & ~mask);
+        }
+    }
+}
+
+#ifdef HAS_X86_KERNELS
+template <int Width>
+__attribute__((target("sse2")))
+static void rasterize_sse2(const uint16_t *bitmap, uint32_t *dst, int stride, uint32_t fg, uint32_t bg) {
+    const __m128i vfg = _mm_set1_epi32(fg);
+    const __m128i vbg = _mm_set1_epi32(bg);
+    __m128i bits[Width / 4];
+    for (int k = 0; k < Width / 4; ++k) {
+        bits[k] = _mm_setr_epi32(1 << (4 * k), 2 << (4 * k), 4 << (4 * k), 8 << (4 * k));
+    }
+    for (int i = 0; i < GlyphHeight; ++i) {
+        __m128i line = _mm_set1_epi32(bitmap[i]);
+        uint32_t *row = dst + (size_t)i * stride;
+        for (int k = 0; k < Width / 4; ++k) {
+            __m128i mask = _mm_cmpeq_epi32(_mm_and_si128(line, bits[k]), bits[k]);
+            __m128i pixels = _mm_or_si128(_mm_and_si128(mask, vfg), _mm_andnot_si128(mask, vbg));
+            _mm_storeu_si128((__m128i *)(row + 4 * k), pixels);
+        }
+    }
+}
+
+template <int Width>
+__attribute__((target("avx2")))
+static void rasterize_avx2(const uint16_t *bitmap, uint32_t *dst, int stride, uint32_t fg, uint32_t bg) {
+    const __m256i vfg = _mm256_set1_epi32(fg);
+    const __m256i vbg = _mm256_set1_epi32(bg);
+    __m256i bits[Width / 8];
+    for (int k = 0; k < Width / 8; ++k) {
+        bits[k] = _mm256_sllv_epi32(_mm256_set1_epi32(1 << (8 * k)),
+            _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    }
+    for (int i = 0; i < GlyphHeight; ++i) {
+        __m256i line = _mm256_set1_epi32(bitmap[i]);
+        uint32_t *row = dst + (size_t)i * stride;
+        for (int k = 0; k < Width / 8; ++k) {
+            __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(line, bits[k]), bits[k]);
+            _mm256_storeu_si256((__m256i *)(row + 8 * k), _mm256_blendv_epi8(vbg, vfg, mask));
+        }
+    }
+}
+#endif
+
+vector<GlyphRasterizer> available_glyph_rasterizers() {
+    vector<GlyphRasterizer> rasterizers;
+    rasterizers.push_back({"scalar", rasterize_scalar<GlyphWidth / 2>, rasterize_scalar<GlyphWidth>});
+#ifdef HAS_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        rasterizers.push_back({"sse2", rasterize_sse2<GlyphWidth / 2>, rasterize_sse2<GlyphWidth>});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        rasterizers.push_back({"avx2", rasterize_avx2<GlyphWidth / 2>, rasterize_avx2<GlyphWidth>});
+    }
+#endif
+    return rasterizers;
+}
+
+const GlyphRasterizer &glyph_rasterizer() {
+    static const GlyphRasterizer rasterizer = available_glyph_rasterizers().back();
+    return rasterizer;
+}
@@ -0,0 +1,54 @@
+#include <map>
+#include <mutex>
+#include "keymap.h"
+
+using namespace std;
+
+// Keymap reference counts are not atomic, so creating and freeing states,
+// which ref and unref the keymap, happens under this lock. Key lookups only
+// read the keymap and need no locking.
+static std::mutex keymap_mutex;
+static xkb_context *keymap_context = nullptr;
+static map<string, xkb_keymap *> keymaps;
+
+static xkb_keymap *compile_keymap(const string &layout) {
+    auto it = keymaps.find(layout);
+    if (it != keymaps.end()) {
+        return it->second;
+    }
+    if (!keymap_context) {
+        keymap_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+        if (!keymap_context) {
+            return nullptr;
+        }
+    }
+    xkb_rule_names names = { 0 };
+    if (!layout.empty()) {
+        names.layout = layout.c_str();
+    }
+    xkb_keymap *keymap = xkb_keymap_new_from_names(keymap_context,
+        layout.empty() ? nullptr : &names, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (keymap) {
+        keymaps.emplace(layout, keymap);
+    }
+    return keymap;
+}
+
+xkb_keymap *shared_keymap(const string &layout) {
+    lock_guard<std::mutex> lock(keymap_mutex);
+    return compile_keymap(layout);
+}
+
+xkb_state *keyboard_state_new(const string &layout) {
+    lock_guard<std::mutex> lock(keymap_mutex);
+    xkb_keymap *keymap = compile_keymap(layout);
+    if (!keymap) {
+        return nullptr;
+    }
+    return xkb_state_new(keymap);
+}
+
+void keyboard_state_free(xkb_state *state) {
+    lock_guard<std::mutex> lock(keymap_mutex);
+    xkb_state_unref(state);
+}
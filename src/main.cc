@@ -3,6 +3,11 @@
 #include <execinfo.h>
 #include "server.h"
 #include "config.h"
+#include "stats.h"
+#include "keymap.h"
+#include "tls.h"
+#include "route_cache.h"
+#include "supervisor.h"
 
 using namespace std;
 
@@ -15,6 +20,7 @@ void crash_handler(int sig) {
 }
 
 Configuration configuration;
+Statistics statistics;
 
 int main(int argc, char **argv) {
     signal(SIGABRT, crash_handler);
@@ -27,6 +33,20 @@ int main(int argc, char **argv) {
     if (!load_configuration(argv[1], configuration)) {
         return -1;
     } 
+    if (!load_tls_credentials() || !install_tls_hook()) {
+        return -1;
+    }
+    // Compiled before forking so that workers share it. Relaying needs no
+    // keymap, so without one only greeters fail.
+    if (!shared_keymap()) {
+        cerr << "Failed to compile the XKB keymap, greeters are disabled.\n";
+    }
+    if (!init_route_cache()) {
+        return -1;
+    }
+    if (configuration.processes > 1) {
+        return supervise();
+    }
     RDPProxyServer server;
     server.run();
     return 0;
@@ -0,0 +1,36 @@
+#include "registry.h"
+
+using namespace std;
+
+SessionRegistry session_registry;
+
+static thread_local SessionShard *current_shard;
+
+uint64_t SessionRegistry::next_id() {
+    return ++last_id;
+}
+
+SessionShard *SessionRegistry::add(SessionInfo *info) {
+    if (!current_shard) {
+        lock_guard<std::mutex> lock(mutex);
+        shards.push_back(make_unique<SessionShard>());
+        current_shard = shards.back().get();
+    }
+    lock_guard<std::mutex> lock(current_shard->mutex);
+    current_shard->sessions.insert(info);
+    return current_shard;
+}
+
+void SessionRegistry::remove(SessionShard *shard, SessionInfo *info) {
+    lock_guard<std::mutex> lock(shard->mutex);
+    shard->sessions.erase(info);
+}
+
+vector<SessionShard *> SessionRegistry::all_shards() {
+    lock_guard<std::mutex> lock(mutex);
+    vector<SessionShard *> result;
+    for (auto &shard : shards) {
+        result.push_back(shard.get());
+    }
+    return result;
+}
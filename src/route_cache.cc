@@ -0,0 +1,172 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <functional>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include "route_cache.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace std;
+
+extern Configuration configuration;
+
+static const size_t MaxTokenLength = 128;
+static const size_t MaxUsernameLength = 64;
+static const size_t MaxCachedBackends = 4;
+// Entries looked at from the token's hash on, the oldest one is replaced.
+static const size_t ProbeLength = 8;
+
+struct RouteData {
+    int64_t expires;
+    uint64_t rate_limit;
+    uint32_t token_length;
+    uint32_t username_length;
+    uint32_t backend_count;
+    char token[MaxTokenLength];
+    char username[MaxUsernameLength];
+    char ips[MaxCachedBackends][INET6_ADDRSTRLEN];
+    uint16_t ports[MaxCachedBackends];
+};
+
+struct RouteEntry {
+    // Odd while the entry is being written.
+    atomic<uint32_t> sequence;
+    RouteData data;
+};
+
+static_assert(atomic<uint32_t>::is_always_lock_free, "entries are shared between processes");
+static_assert(sizeof(RouteData) % sizeof(uint64_t) == 0, "entries are copied by words");
+
+static const size_t RouteWords = sizeof(RouteData) / sizeof(uint64_t);
+
+static RouteEntry *entries;
+static size_t entry_mask;
+
+static int64_t now() {
+    return chrono::steady_clock::now().time_since_epoch().count();
+}
+
+bool init_route_cache() {
+    if (configuration.auth_cache_ttl == 0) {
+        return true;
+    }
+    size_t count = 1;
+    while (count < configuration.auth_cache_size) {
+        count *= 2;
+    }
+    void *p = mmap(nullptr, count * sizeof(RouteEntry), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        cerr << "Cannot map the route cache.\n";
+        return false;
+    }
+    // Anonymous mappings are zeroed: every entry is empty and not being written.
+    entries = (RouteEntry *)p;
+    entry_mask = count - 1;
+    return true;
+}
+
+// Copies entry data a word at a time with atomic accesses: a reader racing a
+// writer gets torn data that its sequence check discards, not a data race.
+static void copy_route(RouteData &to, const RouteData &from) {
+    const uint64_t *src = (const uint64_t *)&from;
+    uint64_t *dst = (uint64_t *)&to;
+    for (size_t i = 0; i < RouteWords; i++) {
+        __atomic_store_n(&dst[i], __atomic_load_n(&src[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+}
+
+// Copies the entry if no writer touched it meanwhile.
+static bool read_entry(RouteEntry &entry, RouteData &data) {
+    uint32_t sequence = entry.sequence.load(memory_order_acquire);
+    if (sequence & 1) {
+        return false;
+    }
+    copy_route(data, entry.data);
+    atomic_thread_fence(memory_order_acquire);
+    return entry.sequence.load(memory_order_relaxed) == sequence;
+}
+
+static bool matches(const RouteData &data, const string &token) {
+    return data.token_length == token.size() && memcmp(data.token, token.data(), token.size()) == 0;
+}
+
+bool lookup_route(const string &token, string &username, vector<Backend> &backends, uint64_t &rate_limit) {
+    if (!entries || token.size() > MaxTokenLength) {
+        return false;
+    }
+    size_t hash = std::hash<string>()(token);
+    int64_t time = now();
+    for (size_t i = 0; i < ProbeLength; i++) {
+        RouteData data;
+        if (!read_entry(entries[(hash + i) & entry_mask], data) || !matches(data, token) || data.expires <= time) {
+            continue;
+        }
+        username.assign(data.username, data.username_length);
+        backends.clear();
+        for (uint32_t j = 0; j < data.backend_count; j++) {
+            backends.push_back({ data.ips[j], data.ports[j] });
+        }
+        rate_limit = data.rate_limit;
+        statistics.route_cache_hits++;
+        return true;
+    }
+    statistics.route_cache_misses++;
+    return false;
+}
+
+void store_route(const string &token, const string &username, const vector<Backend> &backends,
+    uint64_t rate_limit) {
+    if (!entries || token.size() > MaxTokenLength || username.size() > MaxUsernameLength) {
+        return;
+    }
+    RouteData data = {};
+    data.expires = now() + chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::seconds(configuration.auth_cache_ttl)).count();
+    data.rate_limit = rate_limit;
+    data.token_length = token.size();
+    memcpy(data.token, token.data(), token.size());
+    data.username_length = username.size();
+    memcpy(data.username, username.data(), username.size());
+    for (const Backend &backend : backends) {
+        if (data.backend_count == MaxCachedBackends || backend.ip.size() >= INET6_ADDRSTRLEN) {
+            break;
+        }
+        strcpy(data.ips[data.backend_count], backend.ip.c_str());
+        data.ports[data.backend_count] = backend.port;
+        data.backend_count++;
+    }
+    // The entry holding the token, else the one expiring first.
+    size_t hash = std::hash<string>()(token);
+    RouteEntry *victim = nullptr;
+    int64_t victim_expires = INT64_MAX;
+    for (size_t i = 0; i < ProbeLength; i++) {
+        RouteEntry &entry = entries[(hash + i) & entry_mask];
+        RouteData current;
+        if (!read_entry(entry, current)) {
+            continue;
+        }
+        if (matches(current, token)) {
+            victim = &entry;
+            break;
+        }
+        if (current.expires < victim_expires) {
+            victim = &entry;
+            victim_expires = current.expires;
+        }
+    }
+    if (!victim) {
+        return;
+    }
+    uint32_t sequence = victim->sequence.load(memory_order_relaxed);
+    if ((sequence & 1) || !victim->sequence.compare_exchange_strong(sequence, sequence + 1,
+            memory_order_acquire)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    copy_route(victim->data, data);
+    victim->sequence.store(sequence + 2, memory_order_release);
+}
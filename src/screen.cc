@@ -0,0 +1,678 @@
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <tuple>
+#include "screen.h"
+#include "font.h"
+#include "glyph.h"
+#include "stats.h"
+
+using namespace std;
+
+static const char GreeterBanner[] =
+    "欢迎使用Vlab。请输入学号或工号及密码以登录系统。\r\n"
+    "请注意为学号或工号和密码，而非Linux或Windows系统的用户名密码！\r\n"
+    "登录成功后还需要系统的用户名密码\r\n";
+
+struct SurfaceBitsPayload {
+    SURFACE_BITS_COMMAND cmd;
+    vector<uint8_t> data;
+};
+
+struct BitmapPayload {
+    BITMAP_DATA bitmap;
+    vector<uint8_t> data;
+};
+
+// The greeter's first frame, identical for every peer using the same codec and size.
+struct SplashFrame {
+    vector<SurfaceBitsPayload> commands;
+    vector<BitmapPayload> bitmaps;
+    vector<uint64_t> tile_hashes;
+    uint32_t rfx_frame_idx;
+    // Bytes held, counted in statistics.memory_bytes while cached.
+    size_t footprint;
+};
+
+// Tiles with at most this many colors, which covers plain terminal text, compress
+// far better as run-length coded bitmaps than with RemoteFX or NSCodec.
+static const int BitmapMaxColors = 4;
+
+// Tiles are rendered into a scratch buffer with a margin wide enough for the
+// glyphs of cells straddling the tile's top or left edge.
+static const int TileMargin = GlyphWidth;
+static const int ScratchStride = TileTracker::TileSize + 2 * TileMargin;
+
+// The surface and bitmap codecs choose_codec() can pick, the color depth,
+// whether planar bitmaps skip the alpha plane, and the desktop size.
+using SplashKey = tuple<TileCodec, TileCodec, uint32_t, bool, int, int>;
+// Clients can ask for any desktop size, so only the most recently used
+// splashes are kept.
+static const size_t MaxSplashFrames = 8;
+
+struct CachedSplash {
+    shared_ptr<const SplashFrame> frame;
+    uint64_t last_used;
+};
+
+static mutex splash_mutex;
+static map<SplashKey, CachedSplash> splash_frames;
+static uint64_t splash_clock = 0;
+
+// libvterm's allocations, counted in statistics.memory_bytes. Blocks start
+// with their size and are zeroed like with libvterm's default allocator.
+static const size_t TerminalHeaderSize = alignof(max_align_t);
+
+static void *terminal_malloc(size_t size, void *) {
+    char *p = (char *)calloc(1, TerminalHeaderSize + size);
+    if (!p) {
+        return nullptr;
+    }
+    *(size_t *)p = size;
+    statistics.memory_bytes[MemoryTerminals] += size;
+    return p + TerminalHeaderSize;
+}
+
+static void terminal_free(void *ptr, void *) {
+    if (!ptr) {
+        return;
+    }
+    char *p = (char *)ptr - TerminalHeaderSize;
+    statistics.memory_bytes[MemoryTerminals] -= *(size_t *)p;
+    free(p);
+}
+
+static VTermAllocatorFunctions terminal_allocator = { terminal_malloc, terminal_free };
+
+GreeterScreen::GreeterScreen(ScreenSink &sink_) : sink(sink_), codecs {}, has_activated(false),
+    rfx_frame_idx(0), recording(nullptr), screen_width(0), screen_height(0), frame_id(0),
+    vt(nullptr), vt_screen(nullptr), vt_state(nullptr), lines(0), cols(0), cursor_pos {0, 0},
+    cursor_visible(false), drawn_cursor_pos {0, 0}, drawn_cursor_visible(false), default_fg_color(0x00f8f8f2), default_bg_color(0x00272822) {}
+
+GreeterScreen::~GreeterScreen() {
+    if (vt) {
+        vterm_free(vt);
+    }
+}
+
+bool GreeterScreen::init(int width, int height) {
+    screen_width = width;
+    screen_height = height;
+    lines = screen_height / GlyphHeight;
+    cols = screen_width / (GlyphWidth / 2);
+    vt = vterm_new_with_allocator(lines, cols, &terminal_allocator, nullptr);
+    if (!vt) {
+        return false;
+    }
+    vterm_set_utf8(vt, 1);
+    vt_screen = vterm_obtain_screen(vt);
+    vt_state = vterm_obtain_state(vt);
+    vterm_screen_reset(vt_screen, 1);
+    vterm_state_reset(vt_state, 1);
+    memset(&screen_callbacks, 0, sizeof(VTermScreenCallbacks));
+    screen_callbacks.damage = screen_damage;
+    screen_callbacks.movecursor = screen_move_cursor;
+    screen_callbacks.moverect = screen_move_rect;
+    vterm_screen_set_callbacks(vt_screen, &screen_callbacks, this);
+    VTermColor fg, bg;
+    vterm_color_rgb(&fg, (default_fg_color & 0xff000000) >> 24,
+        (default_fg_color & 0xff0000) >> 16, (default_fg_color & 0xff00) >> 8);
+    vterm_color_rgb(&bg, (default_bg_color & 0xff000000) >> 24,
+        (default_bg_color & 0xff0000) >> 16, (default_bg_color & 0xff00) >> 8);
+    vterm_state_set_default_colors(vt_state, &fg, &bg);
+    tiles.reset(screen_width, screen_height);
+    return true;
+}
+
+void GreeterScreen::resize(int width, int height) {
+    screen_width = width;
+    screen_height = height;
+    lines = screen_height / GlyphHeight;
+    cols = screen_width / (GlyphWidth / 2);
+    vterm_set_size(vt, lines, cols);
+    tiles.reset(screen_width, screen_height);
+}
+
+// The first activation draws the splash, later ones repaint everything.
+bool GreeterScreen::activate(const ScreenCodecs &codecs_) {
+    uint32_t depth = codecs_.color_depth;
+    bool has_bitmap = depth == 32 || depth == 24 || depth == 16 || depth == 15;
+    if (!has_bitmap && !codecs_.remotefx && !codecs_.nscodec) {
+        return false;
+    }
+    codecs = codecs_;
+    if (has_activated) {
+        tiles.invalidate(0, 0, screen_width, screen_height);
+        flush();
+        return true;
+    }
+    has_activated = true;
+    draw_splash();
+    return true;
+}
+
+void GreeterScreen::write(const char *data, size_t len) {
+    vterm_input_write(vt, data, len);
+}
+
+void GreeterScreen::invalidate(int x, int y, int w, int h) {
+    tiles.invalidate(x, y, w, h);
+}
+
+int GreeterScreen::screen_damage(VTermRect rect, void *user) {
+    GreeterScreen *screen = (GreeterScreen *)user;
+    screen->damage(rect);
+    return 1;
+}
+
+int GreeterScreen::screen_move_cursor(VTermPos pos, VTermPos oldpos, int visible, void *user) {
+    GreeterScreen *screen = (GreeterScreen *)user;
+    screen->move_cursor(pos, oldpos, visible);
+    return 1;
+}
+
+int GreeterScreen::screen_move_rect(VTermRect dest, VTermRect src, void *user) {
+    GreeterScreen *screen = (GreeterScreen *)user;
+    return screen->move_rect(dest, src);
+}
+
+// Encoders are shared, so the RemoteFX progress of this client is carried over
+// to whichever one is checked out.
+Encoder *GreeterScreen::acquire_encoder() {
+    Encoder *encoder = encoder_pool.acquire(screen_width, screen_height);
+    if (!encoder) {
+        return nullptr;
+    }
+    if (rfx_frame_idx) {
+        encoder->rfx->state = RFX_STATE_SEND_FRAME_DATA;
+        encoder->rfx->frameIdx = rfx_frame_idx;
+    }
+    encoder->scratch.resize(ScratchStride * ScratchStride);
+    return encoder;
+}
+
+void GreeterScreen::release_encoder(Encoder *encoder) {
+    if (encoder->rfx->state == RFX_STATE_SEND_FRAME_DATA) {
+        rfx_frame_idx = encoder->rfx->frameIdx;
+    }
+    encoder_pool.release(encoder);
+}
+
+// Counts the distinct colors of a tile, giving up once there are more than limit.
+static int count_colors(const uint32_t *pixels, int stride, int width, int height, int limit) {
+    uint32_t colors[BitmapMaxColors + 1];
+    int count = 0;
+    uint32_t last = ~pixels[0];
+    for (int i = 0; i < height; ++i) {
+        const uint32_t *row = pixels + i * stride;
+        for (int j = 0; j < width; ++j) {
+            if (row[j] == last) {
+                continue;
+            }
+            last = row[j];
+            if (find(colors, colors + count, last) != colors + count) {
+                continue;
+            }
+            if (count == limit) {
+                return limit + 1;
+            }
+            colors[count++] = last;
+        }
+    }
+    return count;
+}
+
+static void count_codec(TileCodec codec, size_t bytes, chrono::steady_clock::time_point start) {
+    chrono::nanoseconds elapsed = chrono::steady_clock::now() - start;
+    ++statistics.codec_tiles[codec];
+    statistics.codec_bytes[codec] += bytes;
+    statistics.codec_nanoseconds[codec] += elapsed.count();
+}
+
+TileCodec GreeterScreen::choose_codec(const uint32_t *pixels, int stride, int width, int height) {
+    uint32_t depth = codecs.color_depth;
+    bool has_bitmap = depth == 32 || depth == 24 || depth == 16 || depth == 15;
+    bool has_surface = codecs.remotefx || codecs.nscodec;
+    if (has_bitmap && (!has_surface ||
+        count_colors(pixels, stride, width, height, BitmapMaxColors) <= BitmapMaxColors)) {
+        return depth == 32 ? CodecPlanar : CodecInterleaved;
+    }
+    if (codecs.remotefx) {
+        return CodecRemoteFX;
+    }
+    if (codecs.nscodec) {
+        return CodecNSCodec;
+    }
+    return CodecCount;
+}
+
+bool GreeterScreen::encode_tile(Encoder *encoder, const TileRect &tile, const uint32_t *pixels, int stride) {
+    switch (choose_codec(pixels, stride, tile.width, tile.height)) {
+    case CodecRemoteFX:
+        return encode_surface_bits(encoder, true, tile, pixels, stride);
+    case CodecNSCodec:
+        return encode_surface_bits(encoder, false, tile, pixels, stride);
+    case CodecPlanar:
+    case CodecInterleaved:
+        return encode_bitmap(encoder, tile, pixels, stride);
+    default:
+        return false;
+    }
+}
+
+// Each tile is sent as its own message with the tile as the whole image.
+bool GreeterScreen::encode_surface_bits(Encoder *encoder, bool rfx, const TileRect &tile,
+    const uint32_t *pixels, int stride) {
+    SURFACE_BITS_COMMAND cmd = { 0 };
+    Stream_Clear(encoder->stream);
+    Stream_SetPosition(encoder->stream, 0);
+    auto start = chrono::steady_clock::now();
+    if (rfx) {
+        RFX_RECT rect = { 0, 0, (UINT16)tile.width, (UINT16)tile.height };
+        if (!rfx_compose_message(encoder->rfx, encoder->stream, &rect, 1,
+            (uint8_t *)pixels, tile.width, tile.height, stride * 4)) {
+            return false;
+        }
+        cmd.bmp.codecID = codecs.remotefx_codec_id;
+        cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
+    } else {
+        nsc_compose_message(encoder->nsc, encoder->stream,
+            (const uint8_t *)pixels, tile.width, tile.height, stride * 4);
+        cmd.bmp.codecID = codecs.nscodec_codec_id;
+        cmd.cmdType = CMDTYPE_SET_SURFACE_BITS;
+    }
+    count_codec(rfx ? CodecRemoteFX : CodecNSCodec, Stream_GetPosition(encoder->stream), start);
+    cmd.destLeft = tile.x;
+    cmd.destTop = tile.y;
+    cmd.destRight = tile.x + tile.width;
+    cmd.destBottom = tile.y + tile.height;
+    cmd.bmp.bpp = 32;
+    cmd.bmp.flags = 0;
+    cmd.bmp.width = tile.width;
+    cmd.bmp.height = tile.height;
+    cmd.bmp.bitmapDataLength = Stream_GetPosition(encoder->stream);
+    cmd.bmp.bitmapData = Stream_Buffer(encoder->stream);
+    send_surface_bits(cmd);
+    return true;
+}
+
+// Planar at 32bpp, interleaved RLE at lower color depths.
+bool GreeterScreen::encode_bitmap(Encoder *encoder, const TileRect &tile, const uint32_t *pixels, int stride) {
+    uint32_t depth = codecs.color_depth;
+    uint32_t bytes_per_pixel = (depth + 7) / 8;
+    BITMAP_DATA bitmap = { 0 };
+    Stream_SetPosition(encoder->stream, 0);
+    uint8_t *data = Stream_Buffer(encoder->stream);
+    uint32_t size = Stream_Capacity(encoder->stream);
+    auto start = chrono::steady_clock::now();
+    if (depth == 32) {
+        BITMAP_PLANAR_CONTEXT *planar = codecs.skip_alpha ? encoder->planar : encoder->planar_alpha;
+        freerdp_bitmap_planar_context_reset(planar, tile.width, tile.height);
+        if (!freerdp_bitmap_compress_planar(planar, (const uint8_t *)pixels,
+            PIXEL_FORMAT_BGRX32, tile.width, tile.height, stride * 4, data, &size)) {
+            return false;
+        }
+        count_codec(CodecPlanar, size, start);
+    } else {
+        if (!interleaved_compress(encoder->interleaved, data, &size, tile.width, tile.height,
+            (const uint8_t *)pixels, PIXEL_FORMAT_BGRX32, stride * 4, 0, 0, nullptr, depth)) {
+            return false;
+        }
+        count_codec(CodecInterleaved, size, start);
+    }
+    bitmap.destLeft = tile.x;
+    bitmap.destTop = tile.y;
+    bitmap.destRight = tile.x + tile.width - 1;
+    bitmap.destBottom = tile.y + tile.height - 1;
+    bitmap.width = tile.width;
+    bitmap.height = tile.height;
+    bitmap.bitsPerPixel = depth;
+    bitmap.compressed = TRUE;
+    bitmap.bitmapLength = size;
+    bitmap.bitmapDataStream = data;
+    bitmap.cbCompFirstRowSize = 0;
+    bitmap.cbCompMainBodySize = size;
+    bitmap.cbScanWidth = tile.width * bytes_per_pixel;
+    bitmap.cbUncompressedSize = tile.width * tile.height * bytes_per_pixel;
+    send_bitmap(bitmap);
+    return true;
+}
+
+void GreeterScreen::send_bitmap(const BITMAP_DATA &bitmap) {
+    sink.bitmap(bitmap);
+    if (recording) {
+        BitmapPayload payload;
+        payload.bitmap = bitmap;
+        payload.data.assign(bitmap.bitmapDataStream, bitmap.bitmapDataStream + bitmap.bitmapLength);
+        payload.bitmap.bitmapDataStream = nullptr;
+        recording->bitmaps.push_back(move(payload));
+    }
+}
+
+void GreeterScreen::send_surface_bits(const SURFACE_BITS_COMMAND &cmd) {
+    sink.surface_bits(cmd);
+    if (recording) {
+        SurfaceBitsPayload payload;
+        payload.cmd = cmd;
+        payload.data.assign(cmd.bmp.bitmapData, cmd.bmp.bitmapData + cmd.bmp.bitmapDataLength);
+        payload.cmd.bmp.bitmapData = nullptr;
+        recording->commands.push_back(move(payload));
+    }
+}
+
+// Clients whose tiles choose_codec() encodes alike share a splash, whatever
+// capabilities they have beyond that.
+static SplashKey splash_key(const ScreenCodecs &codecs, int width, int height) {
+    uint32_t depth = codecs.color_depth;
+    TileCodec surface = codecs.remotefx ? CodecRemoteFX : codecs.nscodec ? CodecNSCodec : CodecCount;
+    TileCodec bitmap = CodecCount;
+    if (depth == 32) {
+        bitmap = CodecPlanar;
+    } else if (depth == 24 || depth == 16 || depth == 15) {
+        bitmap = CodecInterleaved;
+    }
+    bool skip_alpha = bitmap == CodecPlanar && codecs.skip_alpha;
+    return SplashKey(surface, bitmap, depth, skip_alpha, width, height);
+}
+
+// The cleared screen with the banner is the same for every greeter, so it is
+// encoded once per codec and desktop size and later peers get the recorded
+// SurfaceBits commands. A RemoteFX recording starts with the codec headers, so it
+// is only recorded and replayed on encoders that have not sent anything yet.
+void GreeterScreen::draw_splash() {
+    vterm_input_write(vt, GreeterBanner, sizeof(GreeterBanner) - 1);
+    bool use_rfx = codecs.remotefx;
+    bool fresh_encoder = !use_rfx || rfx_frame_idx == 0;
+    SplashKey key = splash_key(codecs, screen_width, screen_height);
+    shared_ptr<const SplashFrame> splash;
+    {
+        lock_guard<mutex> lock(splash_mutex);
+        auto it = splash_frames.find(key);
+        if (it != splash_frames.end()) {
+            it->second.last_used = ++splash_clock;
+            splash = it->second.frame;
+        }
+    }
+    if (splash && fresh_encoder) {
+        begin_frame();
+        for (const SurfaceBitsPayload &payload : splash->commands) {
+            SURFACE_BITS_COMMAND cmd = payload.cmd;
+            cmd.bmp.codecID = use_rfx ? codecs.remotefx_codec_id : codecs.nscodec_codec_id;
+            cmd.bmp.bitmapData = (BYTE *)payload.data.data();
+            sink.surface_bits(cmd);
+        }
+        for (const BitmapPayload &payload : splash->bitmaps) {
+            BITMAP_DATA bitmap = payload.bitmap;
+            bitmap.bitmapDataStream = (BYTE *)payload.data.data();
+            sink.bitmap(bitmap);
+        }
+        end_frame();
+        rfx_frame_idx = splash->rfx_frame_idx;
+        tiles.restore(splash->tile_hashes);
+        return;
+    }
+    auto frame = make_shared<SplashFrame>();
+    recording = frame.get();
+    tiles.invalidate(0, 0, screen_width, screen_height);
+    flush();
+    recording = nullptr;
+    if (!fresh_encoder || (frame->commands.empty() && frame->bitmaps.empty())) {
+        return;
+    }
+    frame->tile_hashes = tiles.sent_hashes();
+    frame->rfx_frame_idx = rfx_frame_idx;
+    frame->footprint = sizeof(SplashFrame) + frame->tile_hashes.size() * sizeof(uint64_t);
+    for (const SurfaceBitsPayload &payload : frame->commands) {
+        frame->footprint += sizeof(payload) + payload.data.size();
+    }
+    for (const BitmapPayload &payload : frame->bitmaps) {
+        frame->footprint += sizeof(payload) + payload.data.size();
+    }
+    lock_guard<mutex> lock(splash_mutex);
+    // Another greeter may have recorded the same splash meanwhile.
+    if (splash_frames.count(key)) {
+        return;
+    }
+    if (splash_frames.size() == MaxSplashFrames) {
+        auto oldest = min_element(splash_frames.begin(), splash_frames.end(),
+            [](const pair<const SplashKey, CachedSplash> &a, const pair<const SplashKey, CachedSplash> &b) {
+                return a.second.last_used < b.second.last_used;
+            });
+        statistics.memory_bytes[MemorySplashes] -= oldest->second.frame->footprint;
+        splash_frames.erase(oldest);
+    }
+    statistics.memory_bytes[MemorySplashes] += frame->footprint;
+    splash_frames.emplace(key, CachedSplash{ move(frame), ++splash_clock });
+}
+
+// Renders the dirty tiles from the terminal's cells and sends those that changed.
+// There is no framebuffer; the screen only exists as libvterm cells between updates.
+void GreeterScreen::flush() {
+    if (!has_activated) {
+        return;
+    }
+    mark_cursor();
+    dirty_tiles.clear();
+    tiles.collect(dirty_tiles);
+    if (dirty_tiles.empty()) {
+        return;
+    }
+    Encoder *encoder = acquire_encoder();
+    if (!encoder) {
+        for (const TileRect &tile : dirty_tiles) {
+            tiles.invalidate(tile.x, tile.y, tile.width, tile.height);
+        }
+        return;
+    }
+    bool in_frame = false;
+    for (const TileRect &tile : dirty_tiles) {
+        uint32_t *pixels = render_tile(tile, encoder->scratch.data());
+        uint64_t hash;
+        if (!tiles.changed(tile, pixels, ScratchStride, hash)) {
+            continue;
+        }
+        if (!in_frame) {
+            begin_frame();
+            in_frame = true;
+        }
+        if (encode_tile(encoder, tile, pixels, ScratchStride)) {
+            tiles.sent(tile, hash);
+        } else {
+            tiles.retry(tile);
+        }
+    }
+    if (in_frame) {
+        end_frame();
+    }
+    release_encoder(encoder);
+}
+
+void GreeterScreen::begin_frame() {
+    sink.begin_frame(frame_id);
+}
+
+void GreeterScreen::end_frame() {
+    sink.end_frame(frame_id);
+    ++frame_id;
+}
+
+void GreeterScreen::damage(VTermRect rect) {
+    if (rect.start_col >= rect.end_col || rect.start_row >= rect.end_row) {
+        return;
+    }
+    if (rect.start_col < 0 || rect.end_col > cols || rect.start_row < 0 || rect.end_row > lines) {
+        return;
+    }
+    mark_cells(rect);
+}
+
+// The cells are marked on flush, so that moving the cursor before a scroll
+// does not keep the scroll from being a ScreenBlt.
+void GreeterScreen::move_cursor(VTermPos pos, VTermPos oldpos, bool visible) {
+    cursor_pos = pos;
+    cursor_visible = visible;
+}
+
+void GreeterScreen::mark_cursor() {
+    if (cursor_pos.row == drawn_cursor_pos.row && cursor_pos.col == drawn_cursor_pos.col &&
+        cursor_visible == drawn_cursor_visible) {
+        return;
+    }
+    for (VTermPos pos : { drawn_cursor_pos, cursor_pos }) {
+        mark_cells(VTermRect { pos.row, pos.row + 1, pos.col, pos.col + 1 });
+    }
+    drawn_cursor_pos = cursor_pos;
+    drawn_cursor_visible = cursor_visible;
+}
+
+TileRect GreeterScreen::cell_rect(VTermRect rect) const {
+    int padx = (screen_width - cols * GlyphWidth / 2) / 2;
+    int pady = (screen_height - lines * GlyphHeight) / 2;
+    TileRect r;
+    r.x = padx + GlyphWidth / 2 * rect.start_col;
+    r.y = pady + GlyphHeight * rect.start_row;
+    r.width = GlyphWidth / 2 * (rect.end_col - rect.start_col);
+    r.height = GlyphHeight * (rect.end_row - rect.start_row);
+    return r;
+}
+
+// A full-width glyph extends into the next cell, which may be on the next tile.
+void GreeterScreen::mark_cells(VTermRect rect) {
+    rect.end_col = min(rect.end_col + 1, cols);
+    TileRect r = cell_rect(rect);
+    tiles.mark(r.x, r.y, r.width, r.height);
+}
+
+// Scrolls by copying pixels on the client with a ScreenBlt order, so only the
+// exposed cells, which libvterm damages afterwards, have to be encoded.
+bool GreeterScreen::move_rect(VTermRect dest, VTermRect src) {
+    if (!has_activated || !codecs.screen_blt) {
+        return false;
+    }
+    if (src.start_col < 0 || src.end_col > cols || src.start_row < 0 || src.end_row > lines ||
+        dest.start_col < 0 || dest.end_col > cols || dest.start_row < 0 || dest.end_row > lines) {
+        return false;
+    }
+    TileRect s = cell_rect(src);
+    TileRect d = cell_rect(dest);
+    if (s.width <= 0 || s.height <= 0) {
+        return true;
+    }
+    // libvterm calls this after moving the cells, so a tile not sent yet can no
+    // longer be rendered as it was before the move. The client would copy stale
+    // pixels, so such moves are damaged and re-encoded instead.
+    if (tiles.any_dirty(s.x, s.y, s.width, s.height) || tiles.any_dirty(d.x, d.y, d.width, d.height)) {
+        return false;
+    }
+    Encoder *encoder = acquire_encoder();
+    if (!encoder) {
+        return false;
+    }
+    SCRBLT_ORDER scrblt = { 0 };
+    scrblt.nLeftRect = d.x;
+    scrblt.nTopRect = d.y;
+    scrblt.nWidth = d.width;
+    scrblt.nHeight = d.height;
+    scrblt.bRop = 0xcc; // SRCCOPY
+    scrblt.nXSrc = s.x;
+    scrblt.nYSrc = s.y;
+    sink.screen_blt(scrblt);
+    // libvterm has already moved the cells, so the destination renders as what the
+    // client now shows. Tiles that also cover the vacated part of the source still
+    // show the old pixels there and are left dirty.
+    vector<TileRect> moved;
+    tiles.overlapping(d.x, d.y, d.width, d.height, moved);
+    for (const TileRect &tile : moved) {
+        int x1 = max(tile.x, s.x);
+        int y1 = max(tile.y, s.y);
+        int x2 = min(tile.x + tile.width, s.x + s.width);
+        int y2 = min(tile.y + tile.height, s.y + s.height);
+        bool vacated = x1 < x2 && y1 < y2 &&
+            (x1 < d.x || y1 < d.y || x2 > d.x + d.width || y2 > d.y + d.height);
+        if (vacated) {
+            tiles.invalidate(tile.x, tile.y, tile.width, tile.height);
+            continue;
+        }
+        tiles.sync(tile, render_tile(tile, encoder->scratch.data()), ScratchStride);
+    }
+    release_encoder(encoder);
+    // The cursor the client showed was moved along with the text, while the
+    // rendered tiles have it at its current position.
+    VTermPos landed {
+        drawn_cursor_pos.row + dest.start_row - src.start_row,
+        drawn_cursor_pos.col + dest.start_col - src.start_col
+    };
+    for (VTermPos pos : { cursor_pos, landed }) {
+        TileRect r = cell_rect(VTermRect { pos.row, pos.row + 1, pos.col, pos.col + 1 });
+        tiles.invalidate(r.x, r.y, r.width, r.height);
+    }
+    return true;
+}
+
+// Rasterizes every cell overlapping a tile into the scratch buffer and returns
+// the tile's top left pixel in it, rows are ScratchStride pixels apart.
+uint32_t *GreeterScreen::render_tile(const TileRect &tile, uint32_t *scratch) {
+    fill(scratch, scratch + ScratchStride * ScratchStride, (uint32_t)default_bg_color);
+    uint32_t *origin = scratch + TileMargin * ScratchStride + TileMargin;
+    int padx = (screen_width - cols * GlyphWidth / 2) / 2;
+    int pady = (screen_height - lines * GlyphHeight) / 2;
+    // Start one column early for a full-width glyph reaching into the tile.
+    int col1 = max((tile.x - padx) / (GlyphWidth / 2) - 1, 0);
+    int col2 = min((tile.x + tile.width - padx + GlyphWidth / 2 - 1) / (GlyphWidth / 2), cols);
+    int row1 = max((tile.y - pady) / GlyphHeight, 0);
+    int row2 = min((tile.y + tile.height - pady + GlyphHeight - 1) / GlyphHeight, lines);
+    for (int i = row1; i < row2; ++i) {
+        for (int j = col1; j < col2; ++j) {
+            int x = padx + GlyphWidth / 2 * j - tile.x;
+            int y = pady + GlyphHeight * i - tile.y;
+            render_cell(VTermPos { i, j }, origin + y * ScratchStride + x, ScratchStride);
+        }
+    }
+    return origin;
+}
+
+static const uint16_t EmptyGlyph[GlyphHeight] = { 0 };
+
+void GreeterScreen::render_cell(VTermPos pos, uint32_t *dst, int stride) {
+    VTermScreenCell cell;
+    if (!vterm_screen_get_cell(vt_screen, pos, &cell)) {
+        return;
+    }
+    bool reverse = cursor_visible && pos.row == cursor_pos.row && pos.col == cursor_pos.col;
+    uint32_t ch = cell.chars[0];
+    if (ch == (uint32_t)(-1)) {
+        // The right half of a full-width character, only drawn under the cursor.
+        if (reverse) {
+            rasterize_glyph<GlyphWidth / 2>(EmptyGlyph, dst, stride, default_bg_color, default_fg_color);
+        }
+        return;
+    }
+    int width = min((int)cell.width, 2);
+    if (pos.col == cols - 1) {
+        width = 1;
+    }
+    uint32_t fg = default_fg_color;
+    uint32_t bg = default_bg_color;
+    VTermColor fgc = cell.fg;
+    VTermColor bgc = cell.bg;
+    if (!VTERM_COLOR_IS_DEFAULT_FG(&fgc)) {
+      vterm_state_convert_color_to_rgb(vt_state, &fgc);
+      fg = (fgc.rgb.red << 16) | (fgc.rgb.green << 8) | fgc.rgb.blue;
+    }
+    if (!VTERM_COLOR_IS_DEFAULT_BG(&bgc)) {
+      vterm_state_convert_color_to_rgb(vt_state, &bgc);
+      bg = (bgc.rgb.red << 16) | (bgc.rgb.green << 8) | fgc.rgb.blue;
+    }
+    if (reverse) {
+      swap(fg, bg);
+    }
+    const uint16_t *bitmap = ch == 0 ? EmptyGlyph : GlyphBitmap[ch < GlyphBitmapSize ? ch : 0];
+    if (width == 2) {
+        rasterize_glyph<GlyphWidth>(bitmap, dst, stride, fg, bg);
+    } else {
+        rasterize_glyph<GlyphWidth / 2>(bitmap, dst, stride, fg, bg);
+    }
+}
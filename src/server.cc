@@ -1,6 +1,17 @@
+#include <iostream>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 #include "server.h"
 #include "session.h"
 #include "config.h"
+#include "backend.h"
+#include "alloc.h"
+#include "stats.h"
+#include "tls.h"
+#include "upgrade.h"
+#include "admin.h"
 
 using namespace std;
 using boost::asio::ip::tcp;
@@ -9,23 +20,276 @@ using uds = boost::asio::local::stream_protocol; // UDS = Unix Domain Socket
 extern Configuration configuration;
 
 RDPProxyServer::RDPProxyServer() {
-    tcp_acceptor = make_unique<tcp::acceptor>(ioc,
-        tcp::endpoint(tcp::v6(), configuration.port));
-    boost::asio::co_spawn(ioc, [this] { return accept_tcp(); }, boost::asio::detached);
+    // On a live upgrade the previous process's listening sockets are taken
+    // over, so that no connection waiting in their queues is lost.
+    int previous = configuration.upgrade_socket.empty() ? -1 : connect_upgrade_socket();
+    vector<int> listeners;
+    if (previous >= 0 && !receive_listeners(previous, listeners)) {
+        cerr << "Cannot take over from the previous process.\n";
+        close(previous);
+        previous = -1;
+    }
+    for (uint32_t i = 0; i < configuration.threads; i++) {
+        workers.push_back(make_unique<Worker>());
+        if (i >= listeners.size() || !adopt_listener(*workers.back(), listeners[i])) {
+            listen(*workers.back());
+        }
+    }
+    // Still part of the reuseport group, so they keep getting connections.
+    for (size_t i = workers.size(); i < listeners.size(); i++) {
+        adopt_listener(*workers[i % workers.size()], listeners[i]);
+    }
+    cpu_steering = configuration.reuseport_cpu && steer_by_cpu();
+    if (configuration.reuseport_cpu && !cpu_steering) {
+        cerr << "Cannot attach the reuseport CPU program, connections are spread by hash.\n";
+    }
+    // Several accepts in flight per acceptor, so a burst of connections is
+    // drained in one pass of the event loop.
+    for (auto &worker : workers) {
+        for (auto &acceptor : worker->acceptors) {
+            for (uint32_t i = 0; i < configuration.pending_accepts; i++) {
+                boost::asio::co_spawn(worker->ioc,
+                    [this, w = worker.get(), a = acceptor.get()] { return accept_tcp(*w, *a); },
+                    boost::asio::detached);
+            }
+        }
+    }
+    boost::asio::io_context &ioc = workers[0]->ioc;
+    if (previous >= 0) {
+        boost::asio::co_spawn(ioc, [this, &ioc, previous] { return adopt_sessions(ioc, previous); },
+            boost::asio::detached);
+    }
+    if (!configuration.upgrade_socket.empty()) {
+        int fd = listen_upgrade_socket();
+        if (fd >= 0) {
+            boost::asio::co_spawn(ioc, [this, &ioc, fd] { return serve_upgrade(ioc, fd); },
+                boost::asio::detached);
+        }
+    }
+    if (configuration.backend_probe_interval > 0) {
+        boost::asio::co_spawn(ioc, [&ioc] { return probe_backends(ioc); }, boost::asio::detached);
+    }
+    if (!configuration.admin_socket.empty()) {
+        boost::asio::co_spawn(ioc, [&ioc] { return serve_admin(ioc); }, boost::asio::detached);
+    }
+    boost::asio::co_spawn(ioc, [this, &ioc] { return report_statistics(ioc); }, boost::asio::detached);
+    boost::asio::co_spawn(ioc, [this, &ioc] { return reload_credentials(ioc); }, boost::asio::detached);
+}
+
+void RDPProxyServer::listen(Worker &worker) {
+    tcp::endpoint endpoint(tcp::v6(), configuration.port);
+    auto acceptor = make_unique<tcp::acceptor>(worker.ioc);
+    acceptor->open(endpoint.protocol());
+    acceptor->set_option(tcp::acceptor::reuse_address(true));
+    int fd = acceptor->native_handle();
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        cerr << "Cannot set SO_REUSEPORT on the listening socket.\n";
+    }
+    // Connections are only handed to accept() once the client sent data, which
+    // for RDP is the X.224 Connection Request, so no worker wakes up for a
+    // connection it would then have to wait on.
+    int defer = configuration.defer_accept;
+    if (defer > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) != 0) {
+        cerr << "Cannot set TCP_DEFER_ACCEPT on the listening socket.\n";
+    }
+    acceptor->bind(endpoint);
+    acceptor->listen();
+    worker.acceptors.push_back(move(acceptor));
+}
+
+// Takes over a listening socket of the previous process, unless the port
+// changed in between.
+bool RDPProxyServer::adopt_listener(Worker &worker, int fd) {
+    auto acceptor = make_unique<tcp::acceptor>(worker.ioc, socket_protocol(fd), fd);
+    boost::system::error_code ec;
+    if (acceptor->local_endpoint(ec).port() != configuration.port) {
+        return false;
+    }
+    worker.acceptors.push_back(move(acceptor));
+    return true;
+}
+
+// Closing this process's descriptors leaves the sockets to the new process.
+void RDPProxyServer::stop_accepting() {
+    for (auto &worker : workers) {
+        boost::asio::post(worker->ioc, [w = worker.get()] {
+            for (auto &acceptor : w->acceptors) {
+                boost::system::error_code ec;
+                acceptor->close(ec);
+            }
+        });
+    }
+}
+
+void RDPProxyServer::stop() {
+    for (auto &worker : workers) {
+        worker->ioc.stop();
+    }
+}
+
+// Replaces the reuseport hash with the CPU that handled the packet, modulo the
+// number of workers: the n-th socket bound in the group belongs to workers[n],
+// which is pinned to the CPUs steered to it, so a connection is accepted and
+// served on the CPU whose cache already holds its socket.
+bool RDPProxyServer::steer_by_cpu() {
+    sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)workers.size() },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
+    // Attaching to any socket of the group applies to all of them.
+    int fd = workers[0]->acceptors[0]->native_handle();
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+}
+
+// Pins the calling thread to the CPUs whose connections workers[index] gets.
+void RDPProxyServer::pin_worker(size_t index) {
+    if (!cpu_steering) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    unsigned int count = thread::hardware_concurrency();
+    for (unsigned int cpu = index; cpu < count; cpu += workers.size()) {
+        CPU_SET(cpu, &cpus);
+    }
+    if (CPU_COUNT(&cpus) > 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
 }
 
 void RDPProxyServer::run() {
-    ioc.run();
+    vector<thread> threads;
+    for (size_t i = 1; i < workers.size(); i++) {
+        threads.emplace_back([this, i] {
+            pin_worker(i);
+            workers[i]->ioc.run();
+        });
+    }
+    pin_worker(0);
+    workers[0]->ioc.run();
+    for (thread &t : threads) {
+        t.join();
+    }
+}
+
+// Prints the counters to stderr on SIGUSR1.
+boost::asio::awaitable<void> RDPProxyServer::report_statistics(boost::asio::io_context &ioc) {
+    boost::asio::signal_set signals(ioc, SIGUSR1);
+    while (true) {
+        co_await signals.async_wait(boost::asio::use_awaitable);
+        print_statistics(cerr);
+    }
 }
 
-boost::asio::awaitable<void> RDPProxyServer::accept_tcp() {
+// Re-reads the certificate, key and DH parameters on SIGHUP. New greeter
+// connections use them, failures keep the previous ones.
+boost::asio::awaitable<void> RDPProxyServer::reload_credentials(boost::asio::io_context &ioc) {
+    boost::asio::signal_set signals(ioc, SIGHUP);
+    while (true) {
+        co_await signals.async_wait(boost::asio::use_awaitable);
+        if (!load_tls_credentials()) {
+            cerr << "Keeping the previous TLS credentials.\n";
+        }
+    }
+}
+
+// Waits for a new process on upgrade_socket, gives it the listening sockets,
+// then every relayed session, and returns from run() once drained.
+boost::asio::awaitable<void> RDPProxyServer::serve_upgrade(boost::asio::io_context &ioc, int fd) {
+    boost::asio::posix::stream_descriptor listener(ioc, fd);
+    int peer = -1;
+    while (peer < 0) {
+        boost::system::error_code ec;
+        co_await listener.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec) {
+            co_return;
+        }
+        peer = accept_upgrade_socket(fd);
+        if (peer < 0) {
+            continue;
+        }
+        vector<int> listeners;
+        for (auto &worker : workers) {
+            for (auto &acceptor : worker->acceptors) {
+                listeners.push_back(acceptor->native_handle());
+            }
+        }
+        if (!send_listeners(peer, listeners)) {
+            close(peer);
+            peer = -1;
+        }
+    }
+    // upgrade_socket is the new process's now.
+    listener.close();
+    cerr << "Upgrading: handing off relayed sessions.\n";
+    stop_accepting();
+    Session::hand_off_all(ioc, peer);
+    co_await drain(ioc);
+    stop();
+}
+
+// Sessions still connecting hand themselves off once relaying and greeters
+// end with their users, for at most upgrade_drain_timeout seconds.
+boost::asio::awaitable<void> RDPProxyServer::drain(boost::asio::io_context &ioc) {
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(configuration.upgrade_drain_timeout);
+    boost::asio::steady_timer timer(ioc);
+    while (statistics.live_sessions > 0 && chrono::steady_clock::now() < deadline) {
+        timer.expires_after(chrono::seconds(1));
+        co_await timer.async_wait(boost::asio::use_awaitable);
+    }
+    if (statistics.live_sessions > 0) {
+        cerr << "Exiting with " << statistics.live_sessions << " sessions left.\n";
+    }
+}
+
+// Resumes the sessions the previous process hands off, spread across the
+// workers, until it exits.
+boost::asio::awaitable<void> RDPProxyServer::adopt_sessions(boost::asio::io_context &ioc, int fd) {
+    boost::asio::posix::stream_descriptor channel(ioc, fd);
+    size_t next = 0;
+    while (true) {
+        HandoffSession handoff;
+        int result = receive_session(fd, handoff);
+        if (result < 0) {
+            co_return;
+        }
+        if (result == 0) {
+            boost::system::error_code ec;
+            co_await channel.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec) {
+                co_return;
+            }
+            continue;
+        }
+        Worker &worker = *workers[next++ % workers.size()];
+        boost::asio::post(worker.ioc, [&worker, handoff] {
+            try {
+                auto session = make_shared<Session>(worker.ioc, handoff.downstream, handoff.upstream,
+                    handoff.backend, handoff.rate_limit);
+                session->resume();
+            } catch (...) {
+            }
+        });
+    }
+}
+
+boost::asio::awaitable<void> RDPProxyServer::accept_tcp(Worker &worker, tcp::acceptor &acceptor) {
     while (true) {
         try {
-            tcp::socket socket = co_await tcp_acceptor->async_accept(boost::asio::use_awaitable);
-            auto session = make_shared<Session>(ioc, socket);
+            tcp::socket socket = co_await acceptor.async_accept(boost::asio::use_awaitable);
+            set_allocation_phase(PhaseAccept);
+            auto session = make_shared<Session>(worker.ioc, socket);
             session->start();
         } catch(...) {
+            if (!acceptor.is_open()) {
+                co_return;
+            }
             continue;
         }
     }
-}
\ No newline at end of file
+}
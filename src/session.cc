@@ -1,14 +1,23 @@
 #include <iostream>
+#include <chrono>
+#include <mutex>
 #include <thread>
 #include <cstring>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <xkbcommon/xkbcommon.h>
 #include <utf8cpp/utf8.h>
 #include "util.h"
 #include "session.h"
 #include "config.h"
 #include "auth.h"
-#include "font.h"
 #include "key.h"
+#include "stats.h"
+#include "keymap.h"
+#include "alloc.h"
+#include "tls.h"
+#include "upgrade.h"
+#include "framing.h"
 
 using namespace std;
 using boost::asio::ip::tcp;
@@ -17,11 +26,78 @@ static const tuple<bool, bool, string, ssize_t> HandshakeError(false, false, "",
 
 extern Configuration configuration;
 
+static const int MinDesktopWidth = 640;
+static const int MinDesktopHeight = 384;
+
+// Sessions relaying in this process, and once an upgrade started, the
+// connection to the new process they are handed to and the thread sending them.
+static std::mutex handoff_mutex;
+static unordered_map<Session *, weak_ptr<Session>> relaying;
+static int handoff_fd = -1;
+static boost::asio::io_context *handoff_ioc = nullptr;
+// Only touched on handoff_ioc's thread.
+static deque<pair<shared_ptr<Session>, HandoffSession>> handoff_queue;
+static bool handoff_sending = false;
+
 Session::Session(boost::asio::io_context &ioc_, tcp::socket &socket)
-    : ioc(ioc_), downstream_socket(move(socket)), upstream_socket(ioc), has_closed(false) {
+    : ioc(ioc_), downstream_socket(move(socket)), upstream_socket(ioc), backend_limit(nullptr),
+    has_closed(false), handing_off(false), active_relays(0), framing(configuration.relay_framing),
+    rate_limit(0), throttling(false), flow(ioc) {
     downstream_socket.set_option(tcp::no_delay(true));
     downstream_socket.set_option(boost::asio::socket_base::keep_alive(true));
     ip = downstream_socket.remote_endpoint().address().to_string();
+    statistics.memory_bytes[MemorySessions] += sizeof(Session);
+    statistics.live_sessions++;
+    register_info(ModeHandshake);
+}
+
+Session::Session(boost::asio::io_context &ioc_, int downstream, int upstream, const Backend &backend_,
+    uint64_t rate_limit_)
+    : ioc(ioc_), upstream_socket(ioc, socket_protocol(upstream), upstream),
+    downstream_socket(ioc, socket_protocol(downstream), downstream), backend(backend_),
+    backend_limit(nullptr), has_closed(false), handing_off(false), active_relays(0), framing(false),
+    rate_limit(rate_limit_), throttling(false), flow(ioc) {
+    // The previous process handed the streams off at any byte, not between
+    // PDUs, so they are relayed unframed.
+    boost::system::error_code ec;
+    ip = downstream_socket.remote_endpoint(ec).address().to_string();
+    statistics.memory_bytes[MemorySessions] += sizeof(Session);
+    statistics.live_sessions++;
+    info.backend = backend->ip + ":" + to_string(backend->port);
+    register_info(ModeRelay);
+}
+
+Session::~Session() {
+    session_registry.remove(shard, &info);
+    statistics.memory_bytes[MemorySessions] -= sizeof(Session);
+    statistics.live_sessions--;
+}
+
+void Session::register_info(SessionMode mode) {
+    info.session = this;
+    info.id = session_registry.next_id();
+    info.ip = ip;
+    info.created = chrono::steady_clock::now();
+    info.mode = mode;
+    info.token_hash = 0;
+    for (int i = 0; i < DirectionCount; i++) {
+        info.bytes[i] = 0;
+        info.sampled_bytes[i] = 0;
+        info.rates[i] = 0;
+    }
+    info.throttled_nanoseconds = 0;
+    shard = session_registry.add(&info);
+}
+
+void Session::kill() {
+    boost::asio::post(ioc, [self = shared_from_this()] {
+        if (self->rdp) {
+            boost::system::error_code ec;
+            self->downstream_socket.shutdown(tcp::socket::shutdown_both, ec);
+        } else {
+            self->close();
+        }
+    });
 }
 
 void Session::start() {
@@ -32,10 +108,22 @@ void Session::start() {
     );
 }
 
+// Picks up relaying where the previous process left it.
+void Session::resume() {
+    set_allocation_phase(PhaseRelay);
+    backend_registry.acquire(*backend);
+    statistics.sessions_adopted++;
+    start_relay();
+}
+
 void Session::close() {
     if (has_closed) {
         return;
     }
+    {
+        lock_guard<std::mutex> lock(handoff_mutex);
+        relaying.erase(this);
+    }
     if (downstream_socket.is_open()) {
         boost::system::error_code ec;
         downstream_socket.shutdown(tcp::socket::shutdown_both, ec);
@@ -46,44 +134,73 @@ void Session::close() {
         upstream_socket.shutdown(tcp::socket::shutdown_both, ec);
         upstream_socket.close();
     }
+    if (backend) {
+        backend_registry.release(*backend);
+        backend.reset();
+    }
+    flow.timer.cancel();
     has_closed = true;
 }
 
+// Tries the candidates least loaded first, giving each backend_connect_timeout
+// milliseconds before moving on to the next. Backends whose breaker is open are
+// skipped, so with all of them down the client is turned away at once.
+boost::asio::awaitable<bool> Session::connect_upstream(const vector<Backend> &candidates) {
+    for (const Backend &candidate : backend_registry.order(candidates)) {
+        if (!backend_registry.admit(candidate)) {
+            continue;
+        }
+        boost::system::error_code ec = co_await connect_backend(upstream_socket, candidate,
+            configuration.backend_connect_timeout);
+        backend_registry.report(candidate, !ec);
+        if (has_closed) {
+            co_return false;
+        }
+        if (!ec) {
+            backend = candidate;
+            backend_registry.acquire(candidate);
+            co_return true;
+        }
+        boost::system::error_code ignored;
+        upstream_socket.close(ignored);
+    }
+    co_return false;
+}
+
 boost::asio::awaitable<void> Session::handle() {
+    set_allocation_phase(PhaseHandshake);
     try {
         bool success, is_redirection;
         vector<uint8_t> cr_pdu;
         string token;
         size_t neg_offset;
         tie(success, is_redirection, token, neg_offset) = co_await handshake(cr_pdu);
+        set_allocation_phase(PhaseConnect);
         if (!success) {
             close();
             co_return;
         }
         if (is_redirection) {
             string username;
-            string ip;
-            uint16_t port;
-            if (!co_await auth(token, username, ip, port, ioc)) {
+            vector<Backend> backends;
+            if (!co_await auth(token, username, backends, rate_limit, ioc)) {
                 close();
                 co_return;
             }
-            co_await upstream_socket.async_connect(
-                tcp::endpoint(boost::asio::ip::address::from_string(ip), port),
-                boost::asio::use_awaitable);
+            if (!co_await connect_upstream(backends)) {
+                close();
+                co_return;
+            }
+            info.backend = backend->ip + ":" + to_string(backend->port);
+            info.token_hash = std::hash<string>()(token);
+            info.mode.store(ModeRelay, memory_order_release);
+            set_allocation_phase(PhaseRelay);
             upstream_socket.set_option(tcp::no_delay(true));
             //co_await ASYNC_WRITE(upstream_socket, cr_pdu);
-            boost::asio::co_spawn(ioc.get_executor(),
-                [self = shared_from_this(), this] {
-                    return handle_up_to_down();
-                }, boost::asio::detached
-            );
-            boost::asio::co_spawn(ioc.get_executor(),
-                [self = shared_from_this(), this] {
-                    return handle_down_to_up();
-                }, boost::asio::detached
-            );
+            start_relay();
         } else {
+            set_allocation_phase(PhaseGreeter);
+            info.mode = ModeGreeter;
             rdp.reset(new RDPSession(downstream_socket.native_handle(), ioc));
             if (rdp->init()) {
                 std::thread rdp_thread([self = shared_from_this(), this] {
@@ -191,66 +308,307 @@ boost::asio::awaitable<bool> Session::peek_x224_cr_pdu(std::string &cookie, std:
     co_return true;
 }
 
-boost::asio::awaitable<void> Session::handle_up_to_down() {
-    const size_t BufferSize = 65536;
-    vector<uint8_t> buffer(BufferSize);
-    try {
-        while (true) {
-            size_t size = co_await ASYNC_READ_SOME(upstream_socket, buffer, BufferSize);
-            co_await ASYNC_WRITE(downstream_socket, buffer, size);
+// In latency mode the kernel takes no more than relay_notsent_lowat unsent
+// bytes for the client: writes beyond that fail with EAGAIN, so the relay
+// stops reading from the backend and the backlog builds up on the backend's
+// side, which then sends its next update instead of a stale one.
+void Session::configure_relay_sockets() {
+    boost::system::error_code ec;
+    for (tcp::socket *socket : { &downstream_socket, &upstream_socket }) {
+        if (configuration.relay_send_buffer > 0) {
+            socket->set_option(boost::asio::socket_base::send_buffer_size(configuration.relay_send_buffer), ec);
+        }
+        if (configuration.relay_receive_buffer > 0) {
+            socket->set_option(boost::asio::socket_base::receive_buffer_size(configuration.relay_receive_buffer), ec);
         }
-    } catch (std::exception &e) {
-        close();
     }
-    co_return;
+    int lowat = configuration.relay_notsent_lowat;
+    if (lowat > 0 && setsockopt(downstream_socket.native_handle(), IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+            &lowat, sizeof(lowat)) != 0) {
+        cerr << "Cannot set TCP_NOTSENT_LOWAT on a relayed connection.\n";
+    }
 }
 
-boost::asio::awaitable<void> Session::handle_down_to_up() {
-    const size_t BufferSize = 65536;
-    vector<uint8_t> buffer(BufferSize);
-    try {
-        while (true) {
-            size_t size = co_await ASYNC_READ_SOME(downstream_socket, buffer, BufferSize);
-            co_await ASYNC_WRITE(upstream_socket, buffer, size);
+void Session::start_relay() {
+    downstream_socket.non_blocking(true);
+    upstream_socket.non_blocking(true);
+    configure_relay_sockets();
+    bucket.set_rate(rate_limit > 0 ? rate_limit : configuration.session_rate_limit);
+    if (configuration.backend_rate_limit > 0) {
+        backend_limit = backend_registry.limit(*backend);
+    }
+    throttling = bucket.get_rate() > 0 || backend_limit || RelayScheduler::enabled();
+    {
+        lock_guard<std::mutex> lock(handoff_mutex);
+        if (handoff_fd >= 0) {
+            handing_off = true;
+        } else {
+            relaying.emplace(this, weak_from_this());
         }
-    } catch (std::exception &e) {
-        close();
     }
-    co_return;
+    spawn_relays();
 }
 
-RDPSession::RDPSession(int fd_, boost::asio::io_context &ioc_) : fd(fd_), peer(nullptr),
-    context(nullptr), rfx(nullptr), nsc(nullptr), stream(nullptr), has_activated(false),
-    screen_width(640), screen_height(384), frame_id(0), vt(nullptr),
-    default_fg_color(0x00f8f8f2), default_bg_color(0x00272822), in_pipe_fd {-1,-1}, out_pipe_fd {-1,-1},
-    xkb_context_(nullptr), xkb_keymap_(nullptr), xkb_state_(nullptr), ioc(ioc_),
-    has_authenticated(false), has_denied(false), has_redirected(false) {}
+void Session::spawn_relays() {
+    active_relays = 2;
+    boost::asio::co_spawn(ioc.get_executor(),
+        [self = shared_from_this(), this] {
+            return relay(upstream_socket, downstream_socket);
+        }, boost::asio::detached
+    );
+    boost::asio::co_spawn(ioc.get_executor(),
+        [self = shared_from_this(), this] {
+            return relay(downstream_socket, upstream_socket);
+        }, boost::asio::detached
+    );
+}
 
-RDPSession::~RDPSession() {
-    if (in_pipe_fd[0] != -1) {
-        close(in_pipe_fd[0]);
+void Session::hand_off_all(boost::asio::io_context &ioc, int fd) {
+    lock_guard<std::mutex> lock(handoff_mutex);
+    handoff_fd = fd;
+    handoff_ioc = &ioc;
+    for (auto &entry : relaying) {
+        if (shared_ptr<Session> session = entry.second.lock()) {
+            boost::asio::post(session->ioc, [session] {
+                session->hand_off();
+            });
+        }
+    }
+    relaying.clear();
+}
+
+// Relays only ever wait for readiness, so cancelling the waits stops them
+// without losing data: a relay finishes writing what it read and returns.
+void Session::hand_off() {
+    if (has_closed || handing_off) {
+        return;
+    }
+    handing_off = true;
+    boost::system::error_code ec;
+    downstream_socket.cancel(ec);
+    upstream_socket.cancel(ec);
+    flow.timer.cancel();
+}
+
+static void close_handoff(const HandoffSession &session) {
+    if (session.downstream >= 0) {
+        close(session.downstream);
     }
-    if (in_pipe_fd[1] != -1) {
-        close(in_pipe_fd[1]);
+    if (session.upstream >= 0) {
+        close(session.upstream);
     }
-    if (out_pipe_fd[0] != -1) {
-        close(out_pipe_fd[0]);
+}
+
+// Called as each relay returns. Once both did, nothing read is left unwritten
+// and whatever was not read yet is still queued in the sockets, so the new
+// process can take them over as they are.
+void Session::finish_relay() {
+    if (--active_relays > 0 || has_closed) {
+        return;
+    }
+    boost::asio::io_context *sender;
+    {
+        lock_guard<std::mutex> lock(handoff_mutex);
+        sender = handoff_ioc;
+    }
+    // The sender gets its own descriptors, which stay valid even if the
+    // session is closed before its turn comes.
+    HandoffSession session = { fcntl(downstream_socket.native_handle(), F_DUPFD_CLOEXEC, 0),
+        fcntl(upstream_socket.native_handle(), F_DUPFD_CLOEXEC, 0), *backend, rate_limit };
+    if (!sender || session.downstream < 0 || session.upstream < 0) {
+        close_handoff(session);
+        finish_hand_off(false);
+        return;
     }
-    if (out_pipe_fd[1] != -1) {
-        close(out_pipe_fd[1]);
+    // The new process may read slower than sessions come, so the sends wait
+    // on the upgrade thread rather than here.
+    boost::asio::post(*sender, [self = shared_from_this(), session] {
+        handoff_queue.emplace_back(self, session);
+        if (!handoff_sending) {
+            handoff_sending = true;
+            boost::asio::co_spawn(*handoff_ioc, send_handoffs(), boost::asio::detached);
+        }
+    });
+}
+
+// Sends the queued sessions in order, waiting for the new process to make room.
+boost::asio::awaitable<void> Session::send_handoffs() {
+    boost::asio::posix::stream_descriptor channel(*handoff_ioc, handoff_fd);
+    while (!handoff_queue.empty()) {
+        auto [session, handoff] = handoff_queue.front();
+        int result = send_session(handoff_fd, handoff);
+        if (result == 0) {
+            boost::system::error_code ec;
+            co_await channel.async_wait(boost::asio::posix::stream_descriptor::wait_write,
+                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (!ec) {
+                continue;
+            }
+            result = -1;
+        }
+        handoff_queue.pop_front();
+        close_handoff(handoff);
+        boost::asio::post(session->ioc, [session, sent = result > 0] {
+            session->finish_hand_off(sent);
+        });
+    }
+    // The connection stays open for the sessions still to come.
+    channel.release();
+    handoff_sending = false;
+}
+
+void Session::finish_hand_off(bool sent) {
+    if (!sent) {
+        if (has_closed) {
+            return;
+        }
+        cerr << "Cannot hand off a session, relaying it here.\n";
+        handing_off = false;
+        spawn_relays();
+        return;
     }
+    statistics.sessions_handed_off++;
+    // The connections are the new process's now, so no shutdown.
+    boost::system::error_code ec;
+    downstream_socket.close(ec);
+    upstream_socket.close(ec);
+    close();
+}
+
+boost::asio::awaitable<bool> Session::write_all(tcp::socket &to, const uint8_t *data, size_t size) {
+    boost::system::error_code ec;
+    while (size > 0 && !has_closed) {
+        size_t written = to.write_some(boost::asio::buffer(data, size), ec);
+        if (ec == boost::asio::error::would_block) {
+            statistics.relay_write_waits++;
+            // A handoff cancels the wait, the write goes on.
+            co_await to.async_wait(tcp::socket::wait_write,
+                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec && ec != boost::asio::error::operation_aborted) {
+                co_return false;
+            }
+            continue;
+        }
+        if (ec) {
+            co_return false;
+        }
+        data += written;
+        size -= written;
+    }
+    co_return !has_closed;
+}
+
+void Session::account_throttle(ThrottleReason reason, chrono::steady_clock::time_point start) {
+    uint64_t waited = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    statistics.throttled_writes[reason]++;
+    statistics.throttled_nanoseconds[reason] += waited;
+    info.throttled_nanoseconds.store(info.throttled_nanoseconds.load(memory_order_relaxed) + waited,
+        memory_order_relaxed);
+}
+
+// Waits until size more bytes toward the client fit the session's and the
+// backend's rates, then for the turn of the session on its thread's share of
+// rate_limit. Closing or handing off the session cuts the wait short.
+boost::asio::awaitable<void> Session::throttle(size_t size) {
+    if (has_closed || handing_off) {
+        co_return;
+    }
+    auto start = chrono::steady_clock::now();
+    chrono::nanoseconds session_delay = bucket.take(size);
+    chrono::nanoseconds backend_delay(0);
+    if (backend_limit) {
+        backend_delay = backend_limit->take(size);
+    }
+    boost::system::error_code ec;
+    if (session_delay.count() > 0 || backend_delay.count() > 0) {
+        flow.timer.expires_after(max(session_delay, backend_delay));
+        co_await flow.timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        account_throttle(session_delay >= backend_delay ? ThrottleSession : ThrottleBackend, start);
+    }
+    if (!RelayScheduler::enabled() || has_closed || handing_off) {
+        co_return;
+    }
+    start = chrono::steady_clock::now();
+    RelayScheduler &scheduler = RelayScheduler::local(ioc);
+    scheduler.enqueue(flow, size);
+    flow.timer.expires_at(chrono::steady_clock::time_point::max());
+    co_await flow.timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+    if (!flow.granted) {
+        scheduler.remove(flow);
+    }
+    if (flow.delayed) {
+        account_throttle(ThrottleLink, start);
+    }
+}
+
+boost::asio::awaitable<void> Session::relay(tcp::socket &from, tcp::socket &to) {
+    const size_t BufferSize = 65536;
+    const size_t BulkYieldSize = 16384;
+    // Chunks framed between two updates of the shared PDU counters.
+    const uint32_t PublishChunks = 64;
+    vector<uint8_t> buffer(BufferSize);
+    statistics.memory_bytes[MemoryRelayBuffers] += BufferSize;
+    // Holding more than the kernel may queue would only move the backlog here.
+    size_t limit = BufferSize;
+    if (&to == &downstream_socket && configuration.relay_notsent_lowat > 0) {
+        limit = min<size_t>(limit, configuration.relay_notsent_lowat);
+    }
+    bool from_client = &from == &downstream_socket;
+    PduFramer framer(from_client);
+    uint32_t framed_chunks = 0;
+    boost::system::error_code ec;
+    while (!handing_off && !has_closed) {
+        size_t size = from.read_some(boost::asio::buffer(buffer.data(), limit), ec);
+        if (ec == boost::asio::error::would_block) {
+            co_await from.async_wait(tcp::socket::wait_read,
+                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            if (ec && ec != boost::asio::error::operation_aborted) {
+                close();
+            }
+            continue;
+        }
+        set_allocation_phase(PhaseRelay);
+        if (!ec && throttling && !from_client) {
+            co_await throttle(size);
+        }
+        if (ec || !co_await write_all(to, buffer.data(), size)) {
+            close();
+        }
+        atomic<uint64_t> &bytes = info.bytes[from_client ? DirectionUp : DirectionDown];
+        bytes.store(bytes.load(memory_order_relaxed) + size, memory_order_relaxed);
+        if (framing && !has_closed) {
+            size_t bulk = framer.consume(buffer.data(), size);
+            if (++framed_chunks == PublishChunks) {
+                framer.publish();
+                framed_chunks = 0;
+            }
+            // The order within a direction is fixed, but input relayed by
+            // other sessions of this thread need not wait behind this chunk.
+            if (bulk >= BulkYieldSize) {
+                statistics.relay_bulk_yields++;
+                co_await boost::asio::post(ioc, boost::asio::use_awaitable);
+            }
+        }
+    }
+    framer.publish();
+    statistics.memory_bytes[MemoryRelayBuffers] -= BufferSize;
+    finish_relay();
+}
+
+RDPSession::RDPSession(int fd_, boost::asio::io_context &ioc_) : fd(fd_), peer(nullptr),
+    context(nullptr), has_activated(false), screen(*this), output(true), xkb_state_(nullptr), ioc(ioc_),
+    has_authenticated(false), has_denied(false), has_redirected(false) {
+    statistics.memory_bytes[MemoryGreeters] += sizeof(RDPSession);
+}
+
+RDPSession::~RDPSession() {
+    statistics.memory_bytes[MemoryGreeters] -= sizeof(RDPSession);
     if (peer) {
         freerdp_peer_context_free(peer);
         freerdp_peer_free(peer);
     }
     if (xkb_state_) {
-        xkb_state_unref(xkb_state_);
-    }
-    if (xkb_keymap_) {
-        xkb_keymap_unref(xkb_keymap_);
-    }
-    if (xkb_context_) {
-        xkb_context_unref(xkb_context_);
+        keyboard_state_free(xkb_state_);
     }
 }
 
@@ -260,11 +618,6 @@ BOOL RDPSession::rdp_context_new(freerdp_peer *peer_, rdpContext *ctx) {
     return session->context_new();
 }
 
-void RDPSession::rdp_context_free(freerdp_peer *peer_, rdpContext *ctx) {
-    RDPSession* session = (RDPSession *)peer_->ContextExtra;
-    session->context_free();
-}
-
 BOOL RDPSession::rdp_post_connect(freerdp_peer* peer_) {
     RDPSession* session = (RDPSession *)peer_->ContextExtra;
     return session->post_connect();
@@ -290,16 +643,10 @@ void RDPSession::terminal_output_callback(const char *s, size_t len, void *user)
     session->terminal_output(s, len);
 }
 
-int RDPSession::screen_damage(VTermRect rect, void *user) {
-    RDPSession *session = (RDPSession *)user;
-    session->damage(rect);
-    return 1;
-}
-
-int RDPSession::screen_move_cursor(VTermPos pos, VTermPos oldpos, int visible, void *user) {
-    RDPSession *session = (RDPSession *)user;
-    session->move_cursor(pos, oldpos, visible);
-    return 1;
+// Rounds down to whole tiles, which also makes it a whole number of cells.
+static int desktop_size(int requested, int minimum, int maximum) {
+    int size = min(requested, maximum) / TileTracker::TileSize * TileTracker::TileSize;
+    return max(size, minimum);
 }
 
 bool RDPSession::post_connect() {
@@ -311,25 +658,34 @@ bool RDPSession::post_connect() {
             password = peer->settings->Password;
         }
     }
-    if (!rfx_context_reset(rfx, screen_width, screen_height)) {
-        return false;
-    }
-    peer->settings->DesktopWidth = rfx->width;
-    peer->settings->DesktopHeight = rfx->height;
+    // The client asks for its window size. Granting it, capped, with cells that
+    // tile RemoteFX tiles exactly avoids both scaling and partial tiles.
+    requested_width = peer->settings->DesktopWidth;
+    requested_height = peer->settings->DesktopHeight;
+    screen.resize(desktop_size(requested_width, MinDesktopWidth, configuration.max_desktop_width),
+        desktop_size(requested_height, MinDesktopHeight, configuration.max_desktop_height));
+    peer->settings->DesktopWidth = screen.width();
+    peer->settings->DesktopHeight = screen.height();
     peer->update->DesktopResize(context);
-    framebuffer.resize(screen_width * screen_height);
     return true;
 }
 
 bool RDPSession::activate() {
     peer->settings->CompressionLevel = PACKET_COMPR_TYPE_RDP61;
-    for (int i = 0; i < screen_height; ++i) {
-        for (int j = 0; j < screen_width; ++j) {
-            framebuffer[i * screen_width + j] = default_bg_color;
-        }
+    ScreenCodecs codecs;
+    codecs.remotefx = peer->settings->RemoteFxCodec;
+    codecs.nscodec = peer->settings->NSCodec;
+    codecs.screen_blt = peer->settings->OrderSupport[NEG_SCRBLT_INDEX];
+    codecs.color_depth = peer->settings->ColorDepth;
+    codecs.skip_alpha = peer->settings->DrawAllowSkipAlpha;
+    codecs.remotefx_codec_id = peer->settings->RemoteFxCodecId;
+    codecs.nscodec_codec_id = peer->settings->NSCodecId;
+    if (!screen.activate(codecs)) {
+        cerr << "The client supports no codec the greeter can send at color depth "
+            << codecs.color_depth << ".\n";
+        return false;
     }
     has_activated = true;
-    draw_rect(0, 0, screen_width, screen_height);
     return true;
 }
 
@@ -364,11 +720,11 @@ bool RDPSession::keyboard_event(uint16_t flags, uint16_t code) {
         }
         auto it = KeysymVTermKeyMap.find(keysym);
         if (it != KeysymVTermKeyMap.end()) {
-            vterm_keyboard_key(vt, (VTermKey)it->second, (VTermModifier)mod);
+            vterm_keyboard_key(screen.terminal(), (VTermKey)it->second, (VTermModifier)mod);
         } else {
             uint32_t ch = xkb_state_key_get_utf32(xkb_state_, keycode);
             if (ch != '\t') {
-                vterm_keyboard_unichar(vt, ch, (VTermModifier)mod);
+                vterm_keyboard_unichar(screen.terminal(), ch, (VTermModifier)mod);
             }
         }
     }
@@ -381,62 +737,25 @@ bool RDPSession::refresh_rect(BYTE count, const RECTANGLE_16* areas) {
         int y1 = areas[i].top;
         int x2 = areas[i].right;
         int y2 = areas[i].bottom;
-        if (x1 < 0 || y1 < 0 || x2 <= x1 || y2 <= y1 || x2 >= screen_width || y2 >= screen_height) {
+        if (x1 < 0 || y1 < 0 || x2 <= x1 || y2 <= y1 || x2 >= screen.width() || y2 >= screen.height()) {
             continue;
         }
         int w = x2 - x1;
         int h = y2 - y1;
-        draw_rect(x1, y1, w, h);
+        screen.invalidate(x1, y1, w, h);
     }
+    screen.flush();
     return true;
 }
 
-bool RDPSession::draw_rect(int x, int y, int w, int h) {
-    if (!has_activated) {
-        return true;
-    }
-    if (!peer->settings->RemoteFxCodec && !peer->settings->NSCodec) {
-        return false;
-    }
-    Stream_Clear(stream);
-    Stream_SetPosition(stream, 0);
-    RFX_RECT rect;
-    rdpUpdate* update = peer->update;
-    SURFACE_BITS_COMMAND cmd = { 0 };
-    rect.x = 0;
-    rect.y = 0;
-    rect.width = w;
-    rect.height = h;
-    if (peer->settings->RemoteFxCodec) {
-        if (!rfx_compose_message(rfx, stream, &rect, 1,
-            (uint8_t *)(framebuffer.data() + y * screen_width + x), w, h, screen_width * 4)) {
-            return false;
-        }
-        cmd.bmp.codecID = peer->settings->RemoteFxCodecId;
-        cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
-    } else {
-        nsc_compose_message(nsc, stream,
-            (uint8_t *)(framebuffer.data() + y * screen_width + x), w, h, screen_width * 4);
-        cmd.bmp.codecID = peer->settings->NSCodecId;
-        cmd.cmdType = CMDTYPE_SET_SURFACE_BITS;
-    }
-    cmd.destLeft = x;
-    cmd.destTop = y;
-    cmd.destRight = x + w;
-    cmd.destBottom = y + h;
-    cmd.bmp.bpp = 32;
-    cmd.bmp.flags = 0;
-    cmd.bmp.width = w;
-    cmd.bmp.height = h;
-    cmd.bmp.bitmapDataLength = Stream_GetPosition(stream);
-    cmd.bmp.bitmapData = Stream_Buffer(stream);
-    begin_frame();
-    update->SurfaceBits(update->context, &cmd);
-    end_frame();
-    return true;
+// Runs on the session thread, which must not block on the greeter, so bytes
+// that do not fit in the greeter's input ring are dropped. The old pipe blocked
+// here instead. Only keystrokes typed faster than the greeter reads them are lost.
+void RDPSession::terminal_output(const char *s, size_t len) {
+    input.write(s, len);
 }
 
-void RDPSession::begin_frame() {
+void RDPSession::begin_frame(uint32_t frame_id) {
     rdpUpdate* update = peer->update;
     SURFACE_FRAME_MARKER fm = { 0 };
     fm.frameAction = SURFACECMD_FRAMEACTION_BEGIN;
@@ -444,143 +763,33 @@ void RDPSession::begin_frame() {
     update->SurfaceFrameMarker(update->context, &fm);
 }
 
-void RDPSession::end_frame() {
+void RDPSession::end_frame(uint32_t frame_id) {
     rdpUpdate* update = peer->update;
     SURFACE_FRAME_MARKER fm = { 0 };
     fm.frameAction = SURFACECMD_FRAMEACTION_END;
     fm.frameId = frame_id;
     update->SurfaceFrameMarker(update->context, &fm);
-    ++frame_id;
 }
 
-void RDPSession::damage(VTermRect rect) {
-    int x1 = rect.start_col;
-    int x2 = rect.end_col;
-    int y1 = rect.start_row;
-    int y2 = rect.end_row;
-    if (x1 >= x2 || y1 >= y2) {
-        return;
-    }
-    if (x1 < 0 || x2 > cols || y1 < 0 || y2 > lines) {
-        return;
-    }
-    for (int i = y1; i < y2; ++i) {
-        for (int j = x1; j < x2; ++j) {
-            VTermPos pos {i, j};
-            render_cell(pos);
-        }
-    }
-}
-
-void RDPSession::move_cursor(VTermPos pos, VTermPos oldpos, bool visible) {
-    if (pos.row < 0 || pos.row >= lines || pos.col < 0 || pos.col >= cols) {
-        return;
-    }
-    if (visible) {
-        render_cursor(pos);
-    }
-    if (oldpos.row < 0 || oldpos.row >= lines || oldpos.col < 0 || oldpos.col >= cols) {
-        return;
-    }
-    render_cell(oldpos);
-}
-
-void RDPSession::render_cursor(VTermPos pos) {
-    VTermScreenCell cell;
-    if (!vterm_screen_get_cell(vt_screen, pos, &cell)) {
-        return;
-    }
-    int x = pos.col;
-    int y = pos.row;
-    uint32_t ch = cell.chars[0];
-    if (ch == (uint32_t)(-1)) {
-        render_glyph(x, y, 1, 0, default_bg_color, default_fg_color);
-    } else {
-        render_cell(pos, true);
-    }
-}
-
-void RDPSession::render_cell(VTermPos pos, bool reverse) {
-    VTermScreenCell cell;
-    if (!vterm_screen_get_cell(vt_screen, pos, &cell)) {
-        return;
-    }
-    uint32_t ch = cell.chars[0];
-    if (ch == (uint32_t)(-1)) {
-        return;
-    }
-    int x = pos.col;
-    int y = pos.row;
-    if (x < 0 || x >= cols || y < 0 || y >= lines) {
-        return;
-    }
-    int width = cell.width;
-    uint32_t fg = default_fg_color;
-    uint32_t bg = default_bg_color;
-    VTermColor fgc = cell.fg;
-    VTermColor bgc = cell.bg;
-    if (!VTERM_COLOR_IS_DEFAULT_FG(&fgc)) {
-      vterm_state_convert_color_to_rgb(vt_state, &fgc);
-      fg = (fgc.rgb.red << 16) | (fgc.rgb.green << 8) | fgc.rgb.blue;
-    }
-    if (!VTERM_COLOR_IS_DEFAULT_BG(&bgc)) {
-      vterm_state_convert_color_to_rgb(vt_state, &bgc);
-      bg = (bgc.rgb.red << 16) | (bgc.rgb.green << 8) | fgc.rgb.blue;
-    }
-    if (reverse) {
-      swap(fg, bg);
-    }
-    render_glyph(x, y, width, ch, fg, bg);
+void RDPSession::surface_bits(const SURFACE_BITS_COMMAND &cmd) {
+    rdpUpdate* update = peer->update;
+    update->SurfaceBits(update->context, &cmd);
 }
 
-void RDPSession::terminal_output(const char *s, size_t len) {
-    if (in_pipe_fd[1] != -1) {
-        write(in_pipe_fd[1], s, len);
-    }
+void RDPSession::bitmap(const BITMAP_DATA &bitmap) {
+    rdpUpdate* update = peer->update;
+    BITMAP_UPDATE bitmap_update = { 0 };
+    bitmap_update.count = 1;
+    bitmap_update.number = 1;
+    bitmap_update.rectangles = (BITMAP_DATA *)&bitmap;
+    update->BitmapUpdate(update->context, &bitmap_update);
 }
 
-void RDPSession::render_glyph(int x, int y, int width, uint32_t ch, uint32_t fg, uint32_t bg) {
-    if (!has_activated) {
-        return;
-    }
-    if (width > 2) {
-        width = 2;
-    }
-    if (x == cols - 1) {
-        width = 1;
-    }
-    int stride = screen_width;
-    int padx = (screen_width - cols * GlyphWidth / 2) / 2;
-    int pady = (screen_height - lines * GlyphHeight) / 2;
-    int x1 = padx + GlyphWidth / 2 * x;
-    int y1 = pady + GlyphHeight * y;
-    int x2 = x1 + GlyphWidth * width / 2;
-    int y2 = y1 + GlyphHeight;
-    uint32_t *buffer = framebuffer.data() + y1 * stride + x1;
-    size_t glyph_index = ch < GlyphBitmapSize ? ch : 0;
-    if (ch == 0) {
-        for (int i = 0; i < GlyphHeight; ++i) {
-            int gw = width == 2 ? GlyphWidth : GlyphWidth / 2;
-            for (int j = 0; j < gw; ++j) {
-                buffer[i * stride + j] = bg;
-            }
-        }
-    } else {
-        for (int i = 0; i < GlyphHeight; ++i) {
-            uint16_t line = GlyphBitmap[glyph_index][i];
-            int gw = width == 2 ? GlyphWidth : GlyphWidth / 2;
-            for (int j = 0; j < gw; ++j) {
-                if (line & (1 << j)) {
-                    buffer[i * stride + j] = fg;
-                } else {
-                    buffer[i * stride + j] = bg;
-                }
-            }
-        }
-    }
-    if (has_activated) {
-        draw_rect(x1, y1, x2 - x1, y2 - y1);
-    }
+void RDPSession::screen_blt(const SCRBLT_ORDER &order) {
+    rdpUpdate* update = peer->update;
+    update->BeginPaint(update->context);
+    update->primary->ScrBlt(update->context, &order);
+    update->EndPaint(update->context);
 }
 
 bool RDPSession::init() {
@@ -591,12 +800,15 @@ bool RDPSession::init() {
     peer->ContextSize = sizeof(RDPContext);
     peer->ContextExtra = this;
     peer->ContextNew = rdp_context_new;
-    peer->ContextFree = rdp_context_free;
     if (!freerdp_peer_context_new(peer)) {
         return false;
     }
-    peer->settings->CertificateFile = strdup(configuration.cert_chain_file.c_str());
-    peer->settings->PrivateKeyFile = strdup(configuration.private_key_file.c_str());
+    shared_ptr<const TlsCredentials> credentials = tls_credentials();
+    if (!credentials) {
+        return false;
+    }
+    peer->settings->CertificateContent = strdup(credentials->certificate_chain.c_str());
+    peer->settings->PrivateKeyContent = strdup(credentials->private_key.c_str());
     peer->settings->RdpSecurity = false;
     peer->settings->TlsSecurity = true;
     peer->settings->NlaSecurity = false;
@@ -613,41 +825,16 @@ bool RDPSession::init() {
     peer->Initialize(peer);
 
     // init terminal
-    lines = screen_height / GlyphHeight;
-    cols = screen_width / (GlyphWidth / 2);
-    vt = vterm_new(lines, cols);
-    if (!vt) {
-        return false;
-    }
-    vterm_set_utf8(vt, 1);
-    vt_screen = vterm_obtain_screen(vt);
-    vt_state = vterm_obtain_state(vt);
-    vterm_screen_reset(vt_screen, 1);
-    vterm_state_reset(vt_state, 1);
-    memset(&screen_callbacks, 0, sizeof(VTermScreenCallbacks));
-    screen_callbacks.damage = screen_damage;
-    screen_callbacks.movecursor = screen_move_cursor;
-    vterm_screen_set_callbacks(vt_screen, &screen_callbacks, this);
-    vterm_output_set_callback(vt, terminal_output_callback, this);
-    VTermColor fg, bg;
-    vterm_color_rgb(&fg, (default_fg_color & 0xff000000) >> 24,
-        (default_fg_color & 0xff0000) >> 16, (default_fg_color & 0xff00) >> 8);
-    vterm_color_rgb(&bg, (default_bg_color & 0xff000000) >> 24,
-        (default_bg_color & 0xff0000) >> 16, (default_bg_color & 0xff00) >> 8);
-    vterm_state_set_default_colors(vt_state, &fg, &bg);
-    if (pipe(in_pipe_fd) < 0 || pipe(out_pipe_fd) < 0) {
+    if (!screen.init(MinDesktopWidth, MinDesktopHeight)) {
         return false;
     }
-    xkb_context_ = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-    if (!xkb_context_) {
+    vterm_output_set_callback(screen.terminal(), terminal_output_callback, this);
+    if (input.doorbell() == -1 || output.doorbell() == -1) {
         return false;
     }
-    xkb_keymap_ = xkb_keymap_new_from_names(xkb_context_, nullptr, XKB_KEYMAP_COMPILE_NO_FLAGS);
-    if (!xkb_keymap_) {
-        return false;
-    }
-    xkb_state_ = xkb_state_new(xkb_keymap_);
+    xkb_state_ = keyboard_state_new();
     if (!xkb_state_) {
+        cerr << "Cannot create a keyboard state, closing the greeter.\n";
         return false;
     }
     return true;
@@ -655,42 +842,15 @@ bool RDPSession::init() {
 
 bool RDPSession::context_new() {
     ((RDPContext *)context)->session = this;
-    rfx = rfx_context_new(true);
-    if (!rfx) {
-        return false;
-    }
-    if (!rfx_context_reset(rfx, screen_width, screen_height)) {
-        return false;
-    }
-    rfx->mode = RLGR3;
-    rfx_context_set_pixel_format(rfx, PIXEL_FORMAT_BGRA32);
-    nsc = nsc_context_new();
-    if (!nsc) {
-        return false;
-    }
-    if (!nsc_context_set_parameters(nsc, NSC_COLOR_FORMAT, PIXEL_FORMAT_BGRA32)) {
-        return false;
-    }
-    stream = Stream_New(nullptr, 65536);
-    if (!stream) {
-        return false;
-    }
     return true;
 }
 
-void RDPSession::context_free() {
-    if (context) {
-        Stream_Free(stream, true);
-        rfx_context_free(rfx);
-        nsc_context_free(nsc);
-    }
-}
-
 void RDPSession::run(std::shared_ptr<Session> session) {
+    set_allocation_phase(PhaseGreeter);
     HANDLE handles[32];
     DWORD numHandles;
     char buffer[2048];
-    fcntl(out_pipe_fd[0], F_SETFL, fcntl(out_pipe_fd[0], F_GETFL, 0) | O_NONBLOCK);
+    HANDLE output_event = CreateFileDescriptorEvent(NULL, FALSE, FALSE, output.doorbell(), WINPR_FD_READ);
     bool has_started_greeter = false;
     while (true) {
         if (has_activated && !has_started_greeter) {
@@ -702,20 +862,27 @@ void RDPSession::run(std::shared_ptr<Session> session) {
             has_started_greeter = true;
         }
         numHandles = peer->GetEventHandles(peer, handles, 30);
-        handles[numHandles++] = CreateFileDescriptorEvent(NULL, FALSE, FALSE, out_pipe_fd[0], WINPR_FD_READ);
+        handles[numHandles++] = output_event;
         if (numHandles == 0) {
           break;
         }
-        if (WaitForMultipleObjects(numHandles, handles, false, 1000) == WAIT_FAILED) {
+        DWORD timeout = output.wait_prepare() ? 1000 : 0;
+        if (WaitForMultipleObjects(numHandles, handles, false, timeout) == WAIT_FAILED) {
           break;
         }
+        output.wait_finish();
         if (!peer->CheckFileDescriptor(peer)) {
           break;
         }
         if (has_activated) {
-            ssize_t len = read(out_pipe_fd[0], buffer, sizeof(buffer));
-            if (len > 0 && vt) {
-                vterm_input_write(vt, buffer, len);
+            bool has_output = false;
+            size_t len;
+            while ((len = output.read(buffer, sizeof(buffer))) > 0) {
+                screen.write(buffer, len);
+                has_output = true;
+            }
+            if (has_output) {
+                screen.flush();
             }
         }
         if (has_authenticated && !has_redirected) {
@@ -725,6 +892,7 @@ void RDPSession::run(std::shared_ptr<Session> session) {
             break;
         }
     }
+    CloseHandle(output_event);
     peer->Disconnect(peer);
 }
 
@@ -777,25 +945,91 @@ void RDPSession::redirect() {
     rdp_send_pdu(context->rdp, s, PDU_TYPE_SERVER_REDIRECTION, 0);
 }
 
+// Reads the greeter's input ring in batches and hands it out byte by byte.
+class GreeterInput {
+public:
+    GreeterInput(boost::asio::io_context &ioc, GreeterRing &ring_)
+        : ring(ring_), doorbell(ioc, ring_.doorbell()), pos(0), len(0) {}
+    ~GreeterInput() {
+        // The ring owns the eventfd.
+        doorbell.release();
+    }
+    boost::asio::awaitable<char> get() {
+        while (pos == len) {
+            pos = 0;
+            len = ring.read(buffer, sizeof(buffer));
+            if (len > 0) {
+                break;
+            }
+            if (ring.wait_prepare()) {
+                co_await doorbell.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                    boost::asio::use_awaitable);
+                set_allocation_phase(PhaseGreeter);
+                ring.wait_finish();
+            }
+        }
+        co_return buffer[pos++];
+    }
+private:
+    GreeterRing &ring;
+    boost::asio::posix::stream_descriptor doorbell;
+    char buffer[256];
+    size_t pos;
+    size_t len;
+};
+
+// Sleeps on the ring's room doorbell while the output ring is full, until the
+// session thread reads from it.
+static boost::asio::awaitable<void> write_output(GreeterRing &ring, const char *data, size_t len) {
+    while (true) {
+        size_t n = ring.write(data, len);
+        data += n;
+        len -= n;
+        if (len == 0) {
+            break;
+        }
+        if (!ring.room_wait_prepare()) {
+            continue;
+        }
+        boost::asio::posix::stream_descriptor room(co_await boost::asio::this_coro::executor,
+            ring.room_doorbell());
+        boost::system::error_code ec;
+        co_await room.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        // The ring owns the eventfd.
+        room.release();
+        set_allocation_phase(PhaseGreeter);
+        if (ec) {
+            co_return;
+        }
+        ring.room_wait_finish();
+    }
+    co_return;
+}
+
+static boost::asio::awaitable<void> write_output(GreeterRing &ring, const string &s) {
+    return write_output(ring, s.data(), s.length());
+}
+
 static boost::asio::awaitable<bool> read_line(
-    boost::asio::posix::stream_descriptor &in,
-    boost::asio::posix::stream_descriptor &out,
+    GreeterInput &in,
+    GreeterRing &out,
     const string &prompt, string &line, bool visible = true
 ) {
-    co_await ASYNC_WRITE(out, prompt);
+    co_await write_output(out, prompt);
     char ch;
     char mask = '*';
     size_t cursor = line.length();
     string csi_command;
     while (true) {
-        co_await ASYNC_READ(in, &ch, 1);
+        ch = co_await in.get();
         if (ch == '\r' || ch == '\n') {
             break;
         } else if (ch == '\b' || ch == 127) {
             if (cursor == line.length()) {
                 if (!line.empty()) {
                     --cursor;
-                    co_await ASYNC_WRITE(out, "\e[D \e[D", 7);
+                    co_await write_output(out, "\e[D \e[D", 7);
                     line = line.substr(0, line.length() - 1);
                 }
             } else if (cursor > 0) {
@@ -810,12 +1044,12 @@ static boost::asio::awaitable<bool> read_line(
                     echo.resize(echo.length() + s2.length(), mask);
                 }
                 echo += "\e[" + to_string(s2.length()) + "D";
-                co_await ASYNC_WRITE(out, echo);
+                co_await write_output(out, echo);
             }
         } else if (ch == '\e') {
             csi_command = ch;
             while (true) {
-                co_await ASYNC_READ(in, &ch, 1);
+                ch = co_await in.get();
                 csi_command += ch;
                 if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z')) {
                     break;
@@ -836,17 +1070,17 @@ static boost::asio::awaitable<bool> read_line(
                 }
             }
             if (csi_command == "\e[D" && cursor >= 1) {
-                co_await ASYNC_WRITE(out, csi_command);
+                co_await write_output(out, csi_command);
                 --cursor;
             } else if (csi_command == "\e[C" && cursor < line.length()) {
-                co_await ASYNC_WRITE(out, csi_command);
+                co_await write_output(out, csi_command);
                 ++cursor;
             }
         } else {
             if (cursor == line.length()) {
                 line += ch;
                 ++cursor;
-                co_await ASYNC_WRITE(out, visible ? &ch : &mask, 1);
+                co_await write_output(out, visible ? &ch : &mask, 1);
             } else {
                 const string& s1 = line.substr(0, cursor);
                 const string& s2 = line.substr(cursor);
@@ -859,7 +1093,7 @@ static boost::asio::awaitable<bool> read_line(
                     echo.resize(s2.length() + 1, mask);
                 }
                 echo += "\e[" + to_string(s2.length()) + "D";
-                co_await ASYNC_WRITE(out, echo);
+                co_await write_output(out, echo);
             }
         }
     }
@@ -867,25 +1101,20 @@ static boost::asio::awaitable<bool> read_line(
 }
 
 boost::asio::awaitable<void> RDPSession::greeter() {
-    boost::asio::posix::stream_descriptor in(ioc, in_pipe_fd[0]);
-    boost::asio::posix::stream_descriptor out(ioc, out_pipe_fd[1]);
-    string str_banner =
-    "欢迎使用Vlab。请输入学号或工号及密码以登录系统。\r\n"
-    "请注意为学号或工号和密码，而非Linux或Windows系统的用户名密码！\r\n"
-    "登录成功后还需要系统的用户名密码\r\n";
+    GreeterInput in(ioc, input);
+    GreeterRing &out = output;
     string str_username = "学号或工号: ";
     string str_password = "\r\n密码: ";
     string str_invisible = "*";
     string str_wait = "\r\n登录中，请稍候…\r\n";
     string str_failed = "登录失败！请重试。\r\n";
-    co_await ASYNC_WRITE(out, str_banner);
     const int maxRetryTimes = 5;
     for (int i = 0; i < maxRetryTimes; ++i) {
         if (username.empty() || password.empty()) {
             co_await read_line(in, out, str_username, username);
             co_await read_line(in, out, str_password, password, false);
         }
-        co_await ASYNC_WRITE(out, str_wait);
+        co_await write_output(out, str_wait);
         if (co_await auth(username, password, ip, host_username, token, ioc)) {
             has_authenticated = true;
             co_return;
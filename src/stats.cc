@@ -0,0 +1,124 @@
+#include <algorithm>
+#include "stats.h"
+
+using namespace std;
+
+static const char *const CodecNames[CodecCount] = {
+    "remotefx", "nscodec", "planar", "interleaved"
+};
+
+static const char *const PhaseNames[PhaseCount] = {
+    "other", "accept", "handshake", "connect", "relay", "greeter"
+};
+
+static const char *const MemoryNames[MemoryCount] = {
+    "sessions", "relay_buffers", "greeters", "terminals", "encoders", "splashes"
+};
+
+static const char *const PduClassNames[PduClassCount] = {
+    "control", "input", "graphics", "bulk", "unknown"
+};
+
+static const char *const ThrottleNames[ThrottleCount] = {
+    "session", "backend", "link"
+};
+
+// One "name value" line per counter.
+void print_statistics(ostream &os, const Statistics &stats) {
+    os << "tiles_encoded " << stats.tiles_encoded << "\n";
+    os << "tiles_skipped " << stats.tiles_skipped << "\n";
+    os << "encoder_pool_hits " << stats.encoder_pool_hits << "\n";
+    os << "encoder_pool_misses " << stats.encoder_pool_misses << "\n";
+    os << "encoder_pool_bytes_reused " << stats.encoder_pool_bytes_reused << "\n";
+    os << "encoder_size " << stats.encoder_size << "\n";
+    for (int i = 0; i < CodecCount; i++) {
+        os << "codec_tiles." << CodecNames[i] << " " << stats.codec_tiles[i] << "\n";
+        os << "codec_bytes." << CodecNames[i] << " " << stats.codec_bytes[i] << "\n";
+        os << "codec_nanoseconds." << CodecNames[i] << " " << stats.codec_nanoseconds[i] << "\n";
+    }
+    for (int i = 0; i < PhaseCount; i++) {
+        os << "allocations." << PhaseNames[i] << " " << stats.allocations[i] << "\n";
+        os << "heap_allocations." << PhaseNames[i] << " " << stats.heap_allocations[i] << "\n";
+        os << "live_bytes." << PhaseNames[i] << " " << stats.live_bytes[i] << "\n";
+    }
+    for (int i = 0; i < MemoryCount; i++) {
+        os << "memory_bytes." << MemoryNames[i] << " " << stats.memory_bytes[i] << "\n";
+    }
+    os << "tls_handshakes " << stats.tls_handshakes << "\n";
+    os << "tls_resumed_handshakes " << stats.tls_resumed_handshakes << "\n";
+    os << "tls_session_hits " << stats.tls_session_hits << "\n";
+    os << "tls_session_misses " << stats.tls_session_misses << "\n";
+    os << "tls_ticket_hits " << stats.tls_ticket_hits << "\n";
+    os << "tls_ticket_misses " << stats.tls_ticket_misses << "\n";
+    os << "tls_tickets_issued " << stats.tls_tickets_issued << "\n";
+    os << "tls_ticket_key_rotations " << stats.tls_ticket_key_rotations << "\n";
+    os << "live_sessions " << stats.live_sessions << "\n";
+    os << "sessions_handed_off " << stats.sessions_handed_off << "\n";
+    os << "sessions_adopted " << stats.sessions_adopted << "\n";
+    os << "route_cache_hits " << stats.route_cache_hits << "\n";
+    os << "route_cache_misses " << stats.route_cache_misses << "\n";
+    os << "relay_write_waits " << stats.relay_write_waits << "\n";
+    for (int i = 0; i < PduClassCount; i++) {
+        os << "relay_pdus." << PduClassNames[i] << " " << stats.relay_pdus[i] << "\n";
+        os << "relay_pdu_bytes." << PduClassNames[i] << " " << stats.relay_pdu_bytes[i] << "\n";
+    }
+    os << "relay_bulk_yields " << stats.relay_bulk_yields << "\n";
+    for (int i = 0; i < ThrottleCount; i++) {
+        os << "throttled_writes." << ThrottleNames[i] << " " << stats.throttled_writes[i] << "\n";
+        os << "throttled_nanoseconds." << ThrottleNames[i] << " " << stats.throttled_nanoseconds[i] << "\n";
+    }
+}
+
+template<typename T>
+static void add(atomic<T> &to, const atomic<T> &from) {
+    to.store(to.load(memory_order_relaxed) + from.load(memory_order_relaxed), memory_order_relaxed);
+}
+
+// Counters add up, and so do the bytes and sessions held, which are the
+// instance's once summed. encoder_size is each process's own estimate of one
+// encoder, so the largest is kept.
+void merge_statistics(Statistics &total, const Statistics &stats) {
+    add(total.tiles_encoded, stats.tiles_encoded);
+    add(total.tiles_skipped, stats.tiles_skipped);
+    add(total.encoder_pool_hits, stats.encoder_pool_hits);
+    add(total.encoder_pool_misses, stats.encoder_pool_misses);
+    add(total.encoder_pool_bytes_reused, stats.encoder_pool_bytes_reused);
+    total.encoder_size.store(max(total.encoder_size.load(memory_order_relaxed),
+        stats.encoder_size.load(memory_order_relaxed)), memory_order_relaxed);
+    for (int i = 0; i < CodecCount; i++) {
+        add(total.codec_tiles[i], stats.codec_tiles[i]);
+        add(total.codec_bytes[i], stats.codec_bytes[i]);
+        add(total.codec_nanoseconds[i], stats.codec_nanoseconds[i]);
+    }
+    for (int i = 0; i < PhaseCount; i++) {
+        add(total.allocations[i], stats.allocations[i]);
+        add(total.heap_allocations[i], stats.heap_allocations[i]);
+        add(total.live_bytes[i], stats.live_bytes[i]);
+    }
+    for (int i = 0; i < MemoryCount; i++) {
+        add(total.memory_bytes[i], stats.memory_bytes[i]);
+    }
+    add(total.tls_handshakes, stats.tls_handshakes);
+    add(total.tls_resumed_handshakes, stats.tls_resumed_handshakes);
+    add(total.tls_session_hits, stats.tls_session_hits);
+    add(total.tls_session_misses, stats.tls_session_misses);
+    add(total.tls_ticket_hits, stats.tls_ticket_hits);
+    add(total.tls_ticket_misses, stats.tls_ticket_misses);
+    add(total.tls_tickets_issued, stats.tls_tickets_issued);
+    add(total.tls_ticket_key_rotations, stats.tls_ticket_key_rotations);
+    add(total.live_sessions, stats.live_sessions);
+    add(total.sessions_handed_off, stats.sessions_handed_off);
+    add(total.sessions_adopted, stats.sessions_adopted);
+    add(total.route_cache_hits, stats.route_cache_hits);
+    add(total.route_cache_misses, stats.route_cache_misses);
+    add(total.relay_write_waits, stats.relay_write_waits);
+    for (int i = 0; i < PduClassCount; i++) {
+        add(total.relay_pdus[i], stats.relay_pdus[i]);
+        add(total.relay_pdu_bytes[i], stats.relay_pdu_bytes[i]);
+    }
+    add(total.relay_bulk_yields, stats.relay_bulk_yields);
+    for (int i = 0; i < ThrottleCount; i++) {
+        add(total.throttled_writes[i], stats.throttled_writes[i]);
+        add(total.throttled_nanoseconds[i], stats.throttled_nanoseconds[i]);
+    }
+}
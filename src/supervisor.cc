@@ -0,0 +1,172 @@
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "supervisor.h"
+#include "server.h"
+#include "config.h"
+#include "stats.h"
+#include "tls.h"
+
+using namespace std;
+
+extern Configuration configuration;
+
+static const size_t StatisticsWords = sizeof(Statistics) / sizeof(uint64_t);
+static_assert(sizeof(Statistics) % sizeof(uint64_t) == 0, "Statistics is copied as 64-bit words");
+
+// A worker's statistics as of its last publication.
+struct StatisticsSlot {
+    Statistics statistics;
+};
+
+struct WorkerProcess {
+    pid_t pid;
+    chrono::steady_clock::time_point started;
+    bool done;
+};
+
+static StatisticsSlot *slots;
+
+static void publish_statistics(StatisticsSlot &slot) {
+    const uint64_t *from = (const uint64_t *)&statistics;
+    uint64_t *to = (uint64_t *)&slot.statistics;
+    for (size_t i = 0; i < StatisticsWords; i++) {
+        __atomic_store_n(&to[i], __atomic_load_n(&from[i], __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+}
+
+static void collect_statistics(Statistics &total) {
+    memset((void *)&total, 0, sizeof(total));
+    for (uint32_t i = 0; i < configuration.processes; i++) {
+        merge_statistics(total, slots[i].statistics);
+    }
+}
+
+// Forks worker index with the signal mask main() started with. The child
+// exits from here once its server returned, that is after an upgrade handed
+// its sessions to the worker of the same index in the new process tree.
+static pid_t spawn_worker(uint32_t index, const sigset_t &mask) {
+    memset((void *)&slots[index], 0, sizeof(StatisticsSlot));
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
+    if (!configuration.upgrade_socket.empty()) {
+        configuration.upgrade_socket += "." + to_string(index);
+    }
+    if (!configuration.admin_socket.empty()) {
+        configuration.admin_socket += "." + to_string(index);
+    }
+    StatisticsSlot &slot = slots[index];
+    thread([&slot] {
+        while (true) {
+            this_thread::sleep_for(chrono::seconds(1));
+            publish_statistics(slot);
+        }
+    }).detach();
+    RDPProxyServer server;
+    server.run();
+    publish_statistics(slot);
+    exit(0);
+}
+
+int supervise() {
+    uint32_t count = configuration.processes;
+    void *p = mmap(nullptr, count * sizeof(StatisticsSlot), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        cerr << "Cannot map the statistics slots.\n";
+        return -1;
+    }
+    slots = (StatisticsSlot *)p;
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigprocmask(SIG_BLOCK, &signals, &previous);
+    vector<WorkerProcess> workers(count);
+    for (uint32_t i = 0; i < count; i++) {
+        workers[i] = { spawn_worker(i, previous), chrono::steady_clock::now(), false };
+        if (workers[i].pid < 0) {
+            cerr << "Cannot fork a worker process.\n";
+            return -1;
+        }
+    }
+    size_t running = count;
+    uint64_t restarts = 0;
+    bool stopping = false;
+    while (running > 0) {
+        int sig;
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            Statistics total;
+            collect_statistics(total);
+            print_statistics(cerr, total);
+            cerr << "worker_restarts " << restarts << "\n";
+        } else if (sig == SIGHUP) {
+            // Workers forked later start from the supervisor's copy.
+            if (!load_tls_credentials()) {
+                cerr << "Keeping the previous TLS credentials.\n";
+            }
+            for (WorkerProcess &worker : workers) {
+                if (!worker.done) {
+                    kill(worker.pid, SIGHUP);
+                }
+            }
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            stopping = true;
+            for (WorkerProcess &worker : workers) {
+                if (!worker.done) {
+                    kill(worker.pid, SIGTERM);
+                }
+            }
+        } else if (sig == SIGCHLD) {
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                uint32_t i = 0;
+                while (i < count && workers[i].pid != pid) {
+                    i++;
+                }
+                if (i == count) {
+                    continue;
+                }
+                WorkerProcess &worker = workers[i];
+                // Exiting normally means the worker was upgraded and drained.
+                if (stopping || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+                    worker.done = true;
+                    running--;
+                    continue;
+                }
+                cerr << "Worker " << i << " died, restarting it.\n";
+                restarts++;
+                // A worker failing at startup is not restarted in a tight loop.
+                if (chrono::steady_clock::now() - worker.started < chrono::seconds(1)) {
+                    sleep(1);
+                }
+                worker.pid = spawn_worker(i, previous);
+                worker.started = chrono::steady_clock::now();
+                if (worker.pid < 0) {
+                    cerr << "Cannot fork a worker process.\n";
+                    worker.done = true;
+                    running--;
+                }
+            }
+        }
+    }
+    return 0;
+}
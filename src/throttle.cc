@@ -0,0 +1,135 @@
+#include <mutex>
+#include <algorithm>
+#include "throttle.h"
+#include "config.h"
+
+using namespace std;
+
+extern Configuration configuration;
+
+static const double BurstSeconds = 0.1;
+static const double MinBurst = 65536;
+// What a waiting relay earns per turn.
+static const size_t Quantum = 16384;
+
+TokenBucket::TokenBucket() : rate(0), tokens(0) {}
+
+void TokenBucket::set_rate(uint64_t rate_) {
+    rate = rate_;
+    tokens = max(rate * BurstSeconds, MinBurst);
+    last = chrono::steady_clock::now();
+}
+
+uint64_t TokenBucket::get_rate() const {
+    return rate;
+}
+
+chrono::nanoseconds TokenBucket::take(size_t size) {
+    if (rate == 0) {
+        return chrono::nanoseconds(0);
+    }
+    auto now = chrono::steady_clock::now();
+    double burst = max(rate * BurstSeconds, MinBurst);
+    tokens = min(burst, tokens + chrono::duration<double>(now - last).count() * rate);
+    last = now;
+    tokens -= size;
+    if (tokens >= 0) {
+        return chrono::nanoseconds(0);
+    }
+    return chrono::nanoseconds((int64_t)(-tokens * 1e9 / rate));
+}
+
+// rate_limit is for the whole instance, each worker process takes its share.
+static chrono::nanoseconds take_link(size_t size) {
+    static std::mutex mutex;
+    static TokenBucket bucket = [] {
+        TokenBucket bucket;
+        bucket.set_rate(max<uint64_t>(configuration.rate_limit / configuration.processes, 1));
+        return bucket;
+    }();
+    lock_guard<std::mutex> lock(mutex);
+    return bucket.take(size);
+}
+
+RelayFlow::RelayFlow(boost::asio::io_context &ioc) : timer(ioc), request(0), deficit(0), granted(false),
+    delayed(false) {}
+
+RelayScheduler::RelayScheduler(boost::asio::io_context &ioc_) : ioc(ioc_), timer(ioc), pending(nullptr),
+    granting(nullptr), running(false) {}
+
+RelayScheduler &RelayScheduler::local(boost::asio::io_context &ioc) {
+    // Lives as long as the thread's io_context, so it is never freed.
+    thread_local RelayScheduler *scheduler = nullptr;
+    if (!scheduler) {
+        scheduler = new RelayScheduler(ioc);
+    }
+    return *scheduler;
+}
+
+bool RelayScheduler::enabled() {
+    return configuration.rate_limit > 0;
+}
+
+void RelayScheduler::enqueue(RelayFlow &flow, size_t size) {
+    // Earnings only carry over within a backlog, a flow coming back after
+    // being idle starts from nothing.
+    if (&flow != granting) {
+        flow.deficit = 0;
+    }
+    flow.request = size;
+    flow.granted = false;
+    flow.delayed = !active.empty() || pending;
+    active.push_back(&flow);
+    if (!running) {
+        running = true;
+        boost::asio::co_spawn(ioc, [this] { return run(); }, boost::asio::detached);
+    }
+}
+
+void RelayScheduler::remove(RelayFlow &flow) {
+    flow.deficit = 0;
+    if (pending == &flow) {
+        pending = nullptr;
+        return;
+    }
+    auto it = find(active.begin(), active.end(), &flow);
+    if (it != active.end()) {
+        active.erase(it);
+    }
+}
+
+boost::asio::awaitable<void> RelayScheduler::run() {
+    while (!active.empty()) {
+        RelayFlow *flow = active.front();
+        active.pop_front();
+        flow->deficit += Quantum;
+        if (flow->deficit < flow->request) {
+            flow->delayed = flow->delayed || !active.empty();
+            active.push_back(flow);
+            continue;
+        }
+        // What is left is less than a quantum, all a flow can carry over.
+        flow->deficit -= flow->request;
+        chrono::nanoseconds delay = take_link(flow->request);
+        if (delay.count() > 0) {
+            flow->delayed = true;
+            pending = flow;
+            timer.expires_after(delay);
+            boost::system::error_code ec;
+            co_await timer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            flow = pending;
+            pending = nullptr;
+            if (!flow) {
+                continue;
+            }
+        }
+        flow->granted = true;
+        flow->timer.cancel();
+        // A relay still backlogged queues its next chunk before the others
+        // take another turn.
+        granting = flow;
+        co_await boost::asio::post(ioc, boost::asio::use_awaitable);
+        granting = nullptr;
+    }
+    running = false;
+}
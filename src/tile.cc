@@ -0,0 +1,187 @@
+#include <cstring>
+#include <algorithm>
+#include "tile.h"
+#include "stats.h"
+
+using namespace std;
+
+// Hash of a tile that has never been sent, computed hashes never take this value.
+static const uint64_t EmptyHash = 0;
+static const uint64_t HashPrime = 0x100000001b3ull;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_finalize(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Each step (acc ^ v) * prime is a bijection of acc, so any single change in the
+// pixels always yields a different hash. Four lanes keep the multiplies independent.
+uint64_t hash_pixels(const uint32_t *pixels, int stride, int width, int height) {
+    uint64_t acc[4] = {
+        0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull,
+        0x94d049bb133111ebull, 0xcbf29ce484222325ull
+    };
+    for (int i = 0; i < height; ++i) {
+        const uint32_t *row = pixels + (size_t)i * stride;
+        int j = 0;
+        for (; j + 8 <= width; j += 8) {
+            for (int k = 0; k < 4; ++k) {
+                uint64_t v;
+                memcpy(&v, row + j + 2 * k, sizeof(v));
+                acc[k] = (acc[k] ^ v) * HashPrime;
+            }
+        }
+        for (; j < width; ++j) {
+            acc[0] = (acc[0] ^ row[j]) * HashPrime;
+        }
+    }
+    uint64_t h = acc[0] ^ rotl64(acc[1], 16) ^ rotl64(acc[2], 32) ^ rotl64(acc[3], 48);
+    h = hash_finalize(h ^ ((uint64_t)width << 32 | (uint32_t)height));
+    return h == EmptyHash ? 1 : h;
+}
+
+TileTracker::TileTracker() : width(0), height(0), columns(0), rows(0) {}
+
+void TileTracker::reset(int width_, int height_) {
+    width = width_;
+    height = height_;
+    columns = (width + TileSize - 1) / TileSize;
+    rows = (height + TileSize - 1) / TileSize;
+    hashes.assign(columns * rows, EmptyHash);
+    dirty.assign(columns * rows, false);
+}
+
+bool TileTracker::clip(int &x1, int &y1, int &x2, int &y2) const {
+    x1 = max(x1, 0);
+    y1 = max(y1, 0);
+    x2 = min(x2, width);
+    y2 = min(y2, height);
+    return x1 < x2 && y1 < y2;
+}
+
+TileRect TileTracker::tile_rect(int index) const {
+    TileRect rect;
+    rect.x = index % columns * TileSize;
+    rect.y = index / columns * TileSize;
+    rect.width = min(TileSize, width - rect.x);
+    rect.height = min(TileSize, height - rect.y);
+    return rect;
+}
+
+void TileTracker::mark(int x, int y, int w, int h) {
+    int x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+    if (!clip(x1, y1, x2, y2)) {
+        return;
+    }
+    for (int i = y1 / TileSize; i <= (y2 - 1) / TileSize; ++i) {
+        for (int j = x1 / TileSize; j <= (x2 - 1) / TileSize; ++j) {
+            dirty[i * columns + j] = true;
+        }
+    }
+}
+
+void TileTracker::mark_all() {
+    fill(dirty.begin(), dirty.end(), true);
+}
+
+void TileTracker::invalidate(int x, int y, int w, int h) {
+    int x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+    if (!clip(x1, y1, x2, y2)) {
+        return;
+    }
+    for (int i = y1 / TileSize; i <= (y2 - 1) / TileSize; ++i) {
+        for (int j = x1 / TileSize; j <= (x2 - 1) / TileSize; ++j) {
+            dirty[i * columns + j] = true;
+            hashes[i * columns + j] = EmptyHash;
+        }
+    }
+}
+
+// Takes over the state of a tracker that sent the same contents, so nothing is dirty.
+void TileTracker::restore(const vector<uint64_t> &hashes_) {
+    if (hashes_.size() != hashes.size()) {
+        mark_all();
+        return;
+    }
+    hashes = hashes_;
+    fill(dirty.begin(), dirty.end(), false);
+}
+
+int TileTracker::tile_index(const TileRect &tile) const {
+    return tile.y / TileSize * columns + tile.x / TileSize;
+}
+
+void TileTracker::overlapping(int x, int y, int w, int h, vector<TileRect> &tiles) const {
+    int x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+    if (!clip(x1, y1, x2, y2)) {
+        return;
+    }
+    for (int i = y1 / TileSize; i <= (y2 - 1) / TileSize; ++i) {
+        for (int j = x1 / TileSize; j <= (x2 - 1) / TileSize; ++j) {
+            tiles.push_back(tile_rect(i * columns + j));
+        }
+    }
+}
+
+bool TileTracker::any_dirty(int x, int y, int w, int h) const {
+    int x1 = x, y1 = y, x2 = x + w, y2 = y + h;
+    if (!clip(x1, y1, x2, y2)) {
+        return false;
+    }
+    for (int i = y1 / TileSize; i <= (y2 - 1) / TileSize; ++i) {
+        for (int j = x1 / TileSize; j <= (x2 - 1) / TileSize; ++j) {
+            if (dirty[i * columns + j]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Hands out the dirty tiles and clears them; each has to be passed to changed().
+void TileTracker::collect(vector<TileRect> &tiles) {
+    for (size_t index = 0; index < dirty.size(); ++index) {
+        if (!dirty[index]) {
+            continue;
+        }
+        dirty[index] = false;
+        tiles.push_back(tile_rect(index));
+    }
+}
+
+// Returns whether the rendered tile differs from what was sent last, with the
+// hash to pass to sent() once it is on its way to the client.
+bool TileTracker::changed(const TileRect &tile, const uint32_t *pixels, int stride, uint64_t &hash) {
+    hash = hash_pixels(pixels, stride, tile.width, tile.height);
+    if (hash == hashes[tile_index(tile)]) {
+        ++statistics.tiles_skipped;
+        return false;
+    }
+    return true;
+}
+
+void TileTracker::sent(const TileRect &tile, uint64_t hash) {
+    hashes[tile_index(tile)] = hash;
+    ++statistics.tiles_encoded;
+}
+
+// Leaves a tile that could not be sent dirty for the next flush.
+void TileTracker::retry(const TileRect &tile) {
+    dirty[tile_index(tile)] = true;
+}
+
+// Records the rendered tile as already present on the client, e.g. after the
+// client copied it itself.
+void TileTracker::sync(const TileRect &tile, const uint32_t *pixels, int stride) {
+    int index = tile_index(tile);
+    hashes[index] = hash_pixels(pixels, stride, tile.width, tile.height);
+    dirty[index] = false;
+}
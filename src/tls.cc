@@ -0,0 +1,373 @@
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#include "tls.h"
+#include "config.h"
+#include "stats.h"
+
+using namespace std;
+
+extern Configuration configuration;
+
+static std::mutex credentials_mutex;
+static shared_ptr<const TlsCredentials> credentials;
+
+TlsCredentials::TlsCredentials() : dh_params(nullptr) {}
+
+TlsCredentials::~TlsCredentials() {
+    for (X509 *cert : intermediates) {
+        X509_free(cert);
+    }
+    EVP_PKEY_free(dh_params);
+}
+
+static bool read_file(const string &filename, string &content) {
+    ifstream ifs(filename, ios::binary);
+    if (!ifs) {
+        return false;
+    }
+    stringstream ss;
+    ss << ifs.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+// Parses what FreeRDP will parse again per connection, so that a broken file
+// is rejected at load time rather than by every handshake.
+static bool parse_credentials(TlsCredentials &creds) {
+    BIO *bio = BIO_new_mem_buf(creds.certificate_chain.data(), creds.certificate_chain.size());
+    X509 *leaf = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+    if (!leaf) {
+        BIO_free(bio);
+        return false;
+    }
+    while (X509 *cert = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr)) {
+        creds.intermediates.push_back(cert);
+    }
+    ERR_clear_error();
+    BIO_free(bio);
+    bio = BIO_new_mem_buf(creds.private_key.data(), creds.private_key.size());
+    EVP_PKEY *key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+    BIO_free(bio);
+    bool matches = key && X509_check_private_key(leaf, key) == 1;
+    EVP_PKEY_free(key);
+    X509_free(leaf);
+    return matches;
+}
+
+bool load_tls_credentials() {
+    auto creds = make_shared<TlsCredentials>();
+    if (!read_file(configuration.cert_chain_file, creds->certificate_chain) ||
+        !read_file(configuration.private_key_file, creds->private_key)) {
+        cerr << "Cannot read the certificate chain or private key.\n";
+        return false;
+    }
+    if (!parse_credentials(*creds)) {
+        cerr << "Invalid certificate chain or private key.\n";
+        return false;
+    }
+    if (!configuration.dhparam_file.empty()) {
+        BIO *bio = BIO_new_file(configuration.dhparam_file.c_str(), "r");
+        if (bio) {
+            creds->dh_params = PEM_read_bio_Parameters(bio, nullptr);
+            BIO_free(bio);
+        }
+        if (!creds->dh_params) {
+            cerr << "Cannot read the DH parameters.\n";
+            return false;
+        }
+    }
+    lock_guard<std::mutex> lock(credentials_mutex);
+    credentials = creds;
+    return true;
+}
+
+shared_ptr<const TlsCredentials> tls_credentials() {
+    lock_guard<std::mutex> lock(credentials_mutex);
+    return credentials;
+}
+
+// FreeRDP creates an SSL_CTX per peer, so OpenSSL's own session cache and
+// ticket keys die with each connection. Sessions are kept here instead, DER
+// encoded and shared by all peers, with the least recently used evicted
+// beyond tls_session_cache_size. Each worker process has its own cache; the
+// ticket keys below are shared by all of them.
+struct CachedSession {
+    string der;
+    chrono::steady_clock::time_point expires;
+    list<string>::iterator lru;
+};
+
+static std::mutex session_mutex;
+static unordered_map<string, CachedSession> sessions;
+static list<string> session_lru;
+
+static const unsigned char SessionIdContext[] = "rdpproxy";
+
+static int new_session(SSL *, SSL_SESSION *session) {
+    unsigned int id_length;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_length);
+    int length = i2d_SSL_SESSION(session, nullptr);
+    if (length <= 0 || configuration.tls_session_cache_size == 0) {
+        return 0;
+    }
+    string key((const char *)id, id_length);
+    CachedSession cached;
+    cached.der.resize(length);
+    unsigned char *p = (unsigned char *)cached.der.data();
+    i2d_SSL_SESSION(session, &p);
+    cached.expires = chrono::steady_clock::now() + chrono::seconds(configuration.tls_session_timeout);
+    lock_guard<std::mutex> lock(session_mutex);
+    auto it = sessions.find(key);
+    if (it != sessions.end()) {
+        session_lru.erase(it->second.lru);
+        sessions.erase(it);
+    }
+    session_lru.push_front(key);
+    cached.lru = session_lru.begin();
+    sessions.emplace(key, move(cached));
+    while (sessions.size() > configuration.tls_session_cache_size) {
+        sessions.erase(session_lru.back());
+        session_lru.pop_back();
+    }
+    // Not keeping a reference to the session.
+    return 0;
+}
+
+static SSL_SESSION *get_session(SSL *, const unsigned char *id, int id_length, int *copy) {
+    *copy = 0;
+    string key((const char *)id, id_length);
+    string der;
+    {
+        lock_guard<std::mutex> lock(session_mutex);
+        auto it = sessions.find(key);
+        if (it == sessions.end() || it->second.expires < chrono::steady_clock::now()) {
+            if (it != sessions.end()) {
+                session_lru.erase(it->second.lru);
+                sessions.erase(it);
+            }
+            ++statistics.tls_session_misses;
+            return nullptr;
+        }
+        session_lru.splice(session_lru.begin(), session_lru, it->second.lru);
+        der = it->second.der;
+    }
+    ++statistics.tls_session_hits;
+    const unsigned char *p = (const unsigned char *)der.data();
+    return d2i_SSL_SESSION(nullptr, &p, der.size());
+}
+
+static void remove_session(SSL_CTX *, SSL_SESSION *session) {
+    unsigned int id_length;
+    const unsigned char *id = SSL_SESSION_get_id(session, &id_length);
+    lock_guard<std::mutex> lock(session_mutex);
+    auto it = sessions.find(string((const char *)id, id_length));
+    if (it != sessions.end()) {
+        session_lru.erase(it->second.lru);
+        sessions.erase(it);
+    }
+}
+
+// Session tickets are encrypted with a key shared by all peers, replaced every
+// tls_session_timeout seconds. Tickets under the previous key are still
+// accepted and renewed, so a ticket stays usable for at least one timeout.
+// The keys are mapped before the worker processes are forked, so that a ticket
+// is accepted whichever worker the client reconnects to.
+struct TicketKey {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    chrono::steady_clock::time_point created;
+    bool valid;
+};
+
+struct TicketKeys {
+    pthread_mutex_t mutex;
+    TicketKey keys[2];
+};
+
+static TicketKeys *ticket_keys;
+
+// Holds the lock shared by the worker processes. A worker that died holding it
+// may have left the keys half written, they are replaced.
+class TicketLock {
+public:
+    TicketLock() {
+        if (pthread_mutex_lock(&ticket_keys->mutex) == EOWNERDEAD) {
+            ticket_keys->keys[0].valid = false;
+            ticket_keys->keys[1].valid = false;
+            pthread_mutex_consistent(&ticket_keys->mutex);
+        }
+    }
+    ~TicketLock() {
+        pthread_mutex_unlock(&ticket_keys->mutex);
+    }
+    TicketLock(const TicketLock &) = delete;
+    TicketLock &operator=(const TicketLock &) = delete;
+};
+
+static bool init_ticket_keys() {
+    void *p = mmap(nullptr, sizeof(TicketKeys), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        cerr << "Cannot map the TLS ticket keys.\n";
+        return false;
+    }
+    // Anonymous mappings are zeroed: neither key is valid yet.
+    ticket_keys = (TicketKeys *)p;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int error = pthread_mutex_init(&ticket_keys->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (error != 0) {
+        cerr << "Cannot create the TLS ticket key lock.\n";
+        return false;
+    }
+    return true;
+}
+
+// Requires a TicketLock.
+static bool rotate_ticket_keys() {
+    auto now = chrono::steady_clock::now();
+    TicketKey &current = ticket_keys->keys[0];
+    if (current.valid && now - current.created < chrono::seconds(configuration.tls_session_timeout)) {
+        return true;
+    }
+    TicketKey key;
+    if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+        RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+        RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+        return current.valid;
+    }
+    key.created = now;
+    key.valid = true;
+    ticket_keys->keys[1] = current;
+    ticket_keys->keys[0] = key;
+    ++statistics.tls_ticket_key_rotations;
+    return true;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+using TicketMacContext = EVP_MAC_CTX;
+
+static bool init_ticket_mac(EVP_MAC_CTX *mac, unsigned char *key) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, 32),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    return EVP_MAC_CTX_set_params(mac, params) == 1;
+}
+#else
+using TicketMacContext = HMAC_CTX;
+
+static bool init_ticket_mac(HMAC_CTX *mac, unsigned char *key) {
+    return HMAC_Init_ex(mac, key, 32, EVP_sha256(), nullptr) == 1;
+}
+#endif
+
+static int ticket_key_callback(SSL *, unsigned char *key_name, unsigned char *iv,
+    EVP_CIPHER_CTX *cipher, TicketMacContext *mac, int encrypt) {
+    TicketLock lock;
+    if (encrypt) {
+        if (!rotate_ticket_keys() || RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+            return -1;
+        }
+        TicketKey &key = ticket_keys->keys[0];
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1 ||
+            !init_ticket_mac(mac, key.hmac_key)) {
+            return -1;
+        }
+        ++statistics.tls_tickets_issued;
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        TicketKey &key = ticket_keys->keys[i];
+        if (!key.valid || memcmp(key_name, key.name, sizeof(key.name)) != 0) {
+            continue;
+        }
+        if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1 ||
+            !init_ticket_mac(mac, key.hmac_key)) {
+            return -1;
+        }
+        ++statistics.tls_ticket_hits;
+        // A ticket under the previous key is renewed under the current one.
+        return i == 0 ? 1 : 2;
+    }
+    ++statistics.tls_ticket_misses;
+    return 0;
+}
+
+static void handshake_done(const SSL *ssl, int where, int) {
+    if (!(where & SSL_CB_HANDSHAKE_DONE)) {
+        return;
+    }
+    ++statistics.tls_handshakes;
+    if (SSL_session_reused((SSL *)ssl)) {
+        ++statistics.tls_resumed_handshakes;
+    }
+}
+
+// Called by OpenSSL for every SSL_CTX, from SSL_CTX_new() once its method and
+// certificate store exist. FreeRDP creates one server context per peer and
+// then sets the leaf certificate and key on the SSL from the PEM text.
+static void tls_context_new(void *parent, void *, CRYPTO_EX_DATA *, int, long, void *) {
+    SSL_CTX *ctx = (SSL_CTX *)parent;
+    if (SSL_CTX_get_ssl_method(ctx) != TLS_server_method()) {
+        return;
+    }
+    shared_ptr<const TlsCredentials> creds = tls_credentials();
+    if (!creds) {
+        return;
+    }
+    for (X509 *cert : creds->intermediates) {
+        SSL_CTX_add1_chain_cert(ctx, cert);
+    }
+    if (creds->dh_params) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        EVP_PKEY_up_ref(creds->dh_params);
+        if (!SSL_CTX_set0_tmp_dh_pkey(ctx, creds->dh_params)) {
+            EVP_PKEY_free(creds->dh_params);
+        }
+#else
+        SSL_CTX_set_tmp_dh(ctx, EVP_PKEY_get0_DH(creds->dh_params));
+#endif
+    }
+    // Resumed handshakes skip the certificate and private key operation.
+    SSL_CTX_set_session_id_context(ctx, SessionIdContext, sizeof(SessionIdContext) - 1);
+    SSL_CTX_set_timeout(ctx, configuration.tls_session_timeout);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, new_session);
+    SSL_CTX_sess_set_get_cb(ctx, get_session);
+    SSL_CTX_sess_set_remove_cb(ctx, remove_session);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_callback);
+#endif
+    SSL_CTX_set_info_callback(ctx, handshake_done);
+}
+
+bool install_tls_hook() {
+    if (!init_ticket_keys()) {
+        return false;
+    }
+    return SSL_CTX_get_ex_new_index(0, nullptr, tls_context_new, nullptr, nullptr) >= 0;
+}
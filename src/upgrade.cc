@@ -0,0 +1,200 @@
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "upgrade.h"
+#include "config.h"
+
+using namespace std;
+using boost::asio::ip::tcp;
+
+extern Configuration configuration;
+
+// Enough for one listening socket per thread.
+static const size_t MaxHandoffFds = 1024;
+static const size_t MaxMessageSize = 256;
+
+static bool upgrade_address(sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (configuration.upgrade_socket.size() >= sizeof(addr.sun_path)) {
+        cerr << "upgrade_socket is too long.\n";
+        return false;
+    }
+    memcpy(addr.sun_path, configuration.upgrade_socket.data(), configuration.upgrade_socket.size());
+    return true;
+}
+
+int listen_upgrade_socket() {
+    sockaddr_un addr;
+    if (!upgrade_address(addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(addr.sun_path);
+    // Only our user may connect and take the listening sockets and sessions.
+    mode_t mask = umask(077);
+    int result = bind(fd, (sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (result != 0 || listen(fd, 1) != 0) {
+        cerr << "Cannot listen on upgrade_socket.\n";
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int accept_upgrade_socket(int fd) {
+    int peer = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peer < 0) {
+        return -1;
+    }
+    ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(peer, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0 || cred.uid != geteuid()) {
+        cerr << "Rejected an upgrade from another user.\n";
+        close(peer);
+        return -1;
+    }
+    return peer;
+}
+
+int connect_upgrade_socket() {
+    sockaddr_un addr;
+    if (!upgrade_address(addr)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns the message length, or -1 with errno set.
+static ssize_t send_message(int fd, const string &message, const vector<int> &fds, int flags) {
+    iovec iov = { (void *)message.data(), message.size() };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+    if (!fds.empty()) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent;
+}
+
+// Returns the message length, 0 at end of stream, or -1 with errno set.
+static ssize_t receive_message(int fd, string &message, vector<int> &fds, int flags) {
+    char data[MaxMessageSize];
+    iovec iov = { data, sizeof(data) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    vector<char> control(CMSG_SPACE(MaxHandoffFds * sizeof(int)));
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t size;
+    do {
+        size = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+    } while (size < 0 && errno == EINTR);
+    if (size <= 0) {
+        return size;
+    }
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *p = (const int *)CMSG_DATA(cmsg);
+            fds.insert(fds.end(), p, p + count);
+        }
+    }
+    message.assign(data, size);
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return size;
+}
+
+static void close_all(const vector<int> &fds) {
+    for (int fd : fds) {
+        close(fd);
+    }
+}
+
+bool send_listeners(int fd, const vector<int> &listeners) {
+    return send_message(fd, "listeners", listeners, 0) > 0;
+}
+
+bool receive_listeners(int fd, vector<int> &listeners) {
+    string message;
+    if (receive_message(fd, message, listeners, 0) <= 0 || message != "listeners") {
+        close_all(listeners);
+        listeners.clear();
+        return false;
+    }
+    return true;
+}
+
+int send_session(int fd, const HandoffSession &session) {
+    string message = "session " + to_string(session.backend.port) + " " + session.backend.ip + " " +
+        to_string(session.rate_limit);
+    ssize_t size = send_message(fd, message, { session.downstream, session.upstream }, MSG_DONTWAIT);
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return size > 0 ? 1 : -1;
+}
+
+int receive_session(int fd, HandoffSession &session) {
+    string message;
+    vector<int> fds;
+    ssize_t size = receive_message(fd, message, fds, MSG_DONTWAIT);
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    istringstream iss(message);
+    string type;
+    if (size <= 0 || !(iss >> type >> session.backend.port >> session.backend.ip) ||
+        type != "session" || fds.size() != 2) {
+        close_all(fds);
+        return -1;
+    }
+    // Processes from before rate limits send none.
+    if (!(iss >> session.rate_limit)) {
+        session.rate_limit = 0;
+    }
+    session.downstream = fds[0];
+    session.upstream = fds[1];
+    return 1;
+}
+
+tcp socket_protocol(int fd) {
+    sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    if (getsockname(fd, (sockaddr *)&addr, &length) == 0 && addr.ss_family == AF_INET) {
+        return tcp::v4();
+    }
+    return tcp::v6();
+}